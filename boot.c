@@ -25,6 +25,18 @@
 /* Global handle for the current executable */
 static EFI_HANDLE MainImageHandle = NULL;
 
+/* Root of the FAT boot volume, where we keep our profile table */
+static EFI_FILE_HANDLE BootRoot = NULL;
+
+/* Settings for the platform we are running on */
+static BOOT_PROFILE Profile = { 0 };
+
+/* How reads should be issued to the boot disk */
+static IO_PROFILE IoProfile = { 0 };
+
+/* Whether this boot was recorded, which must only happen once, even if we relaunch */
+static BOOLEAN BootRecorded = FALSE;
+
 /* Strings used to identify the plaform */
 #if defined(_M_X64) || defined(__x86_64__)
   static CHAR16* Arch = L"x64";
@@ -70,6 +82,394 @@ static CHAR16* GetDriverName(CONST EFI_HANDLE DriverHandle)
 	return L"(unknown driver)";
 }
 
+/*
+ * The bootloaders we look for, in order of preference, unless a list is
+ * provided in LOADERS_PATH. '<arch>' is replaced with the UEFI architecture.
+ */
+#define LOADERS_PATH        L"\\efi\\rufus\\loaders.txt"
+
+static CONST CHAR8* DefaultLoaders[] = {
+	"\\efi\\boot\\boot<arch>.efi",
+	"\\efi\\microsoft\\boot\\bootmgfw.efi",
+	"\\efi\\boot\\shim<arch>.efi",
+	"\\efi\\boot\\grub<arch>.efi",
+};
+
+static CHAR16 LoaderPathBuffer[MAX_PATH_CANDIDATES][PATH_MAX];
+static CHAR16* LoaderPath[MAX_PATH_CANDIDATES];
+static UINTN LoaderCount = 0;
+
+/* Bootloader images we already read, so that a relaunch doesn't hit the disk */
+static VOID* LoaderImage[MAX_PATH_CANDIDATES] = { NULL };
+static UINTN LoaderImageSize[MAX_PATH_CANDIDATES] = { 0 };
+static FILE_IDENTITY LoaderIdentity[MAX_PATH_CANDIDATES];
+
+/* Add a bootloader to our list of candidates, from an ASCII path */
+static VOID AddLoaderCandidate(CONST CHAR8* Template, CONST UINTN Len)
+{
+	CHAR16* Path;
+	UINTN i, j, k;
+
+	if ((LoaderCount >= MAX_PATH_CANDIDATES) || (Len == 0) ||
+		((Template[0] != '\\') && (Template[0] != '/')))
+		return;
+
+	Path = LoaderPathBuffer[LoaderCount];
+	for (i = 0, j = 0; (i < Len) && (j < PATH_MAX - 1); i++) {
+		if ((i + 6 <= Len) && (CompareMem(&Template[i], "<arch>", 6) == 0)) {
+			for (k = 0; (Arch[k] != 0) && (j < PATH_MAX - 1); k++)
+				Path[j++] = Arch[k];
+			i += 5;
+		} else {
+			Path[j++] = (Template[i] == '/') ? L'\\' : (CHAR16)Template[i];
+		}
+	}
+	Path[j] = 0;
+	LoaderPath[LoaderCount++] = Path;
+}
+
+/*
+ * Build the list of bootloader candidates, either from the one-path-per-line
+ * list we find on the boot volume, or from our defaults.
+ */
+static VOID GetLoaderCandidates(VOID)
+{
+	CHAR8 List[2048];
+	UINTN i, Start, End, Size = sizeof(List);
+
+	LoaderCount = 0;
+	if ((BootRoot != NULL) && (ReadFileData(BootRoot, LOADERS_PATH, List, &Size) == EFI_SUCCESS)) {
+		for (Start = 0; Start < Size; Start = End + 1) {
+			for (End = Start; (End < Size) && (List[End] != '\n'); End++);
+			// Trim whitespaces and ignore comments
+			for (; (Start < End) && ((List[Start] == ' ') || (List[Start] == '\t')); Start++);
+			for (i = End; (i > Start) && ((List[i - 1] == ' ') || (List[i - 1] == '\t') || (List[i - 1] == '\r')); i--);
+			if ((i > Start) && (List[Start] != '#'))
+				AddLoaderCandidate(&List[Start], i - Start);
+		}
+		if (LoaderCount != 0) {
+			PrintDebug(L"Using %d bootloader(s) from '%s'", LoaderCount, &LOADERS_PATH[1]);
+			return;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(DefaultLoaders); i++) {
+		for (Size = 0; DefaultLoaders[i][Size] != 0; Size++);
+		AddLoaderCandidate(DefaultLoaders[i], Size);
+	}
+}
+
+/* Case insensitive check for a file name that starts with Prefix and ends with Suffix */
+static BOOLEAN MatchName(CONST CHAR16* Name, CONST CHAR16* Prefix, CONST CHAR16* Suffix)
+{
+	UINTN i, NameLen = SafeStrLen(Name), PrefixLen = SafeStrLen(Prefix), SuffixLen = SafeStrLen(Suffix);
+
+	if (NameLen < PrefixLen + SuffixLen)
+		return FALSE;
+	for (i = 0; i < PrefixLen; i++) {
+		if (_tolower(Name[i]) != _tolower(Prefix[i]))
+			return FALSE;
+	}
+	for (i = 0; i < SuffixLen; i++) {
+		if (_tolower(Name[NameLen - SuffixLen + i]) != _tolower(Suffix[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Check, from its headers, that a driver we found on the boot partition is
+ * something that this platform will agree to start.
+ */
+static BOOLEAN IsUsableDriver(CONST CHAR16* Path, CONST CHAR16* Name, CONST INTN SecureBootStatus, PE_INFO* PeInfo)
+{
+	if (GetPeInfo(BootRoot, Path, PeInfo) != EFI_SUCCESS) {
+		PrintDebug(L"  Skipping '%s': Not a valid executable", Name);
+		return FALSE;
+	}
+	if (!PeInfo->NativeMachine) {
+		PrintDebug(L"  Skipping '%s': Wrong architecture (0x%04x)", Name, PeInfo->Machine);
+		return FALSE;
+	}
+	// Some HP firmwares refuse to start drivers that are not boot services drivers
+	if (PeInfo->Subsystem != PE_SUBSYSTEM_BOOT_DRIVER) {
+		PrintDebug(L"  Skipping '%s': Not a Boot System Driver (%d)", Name, PeInfo->Subsystem);
+		return FALSE;
+	}
+	if ((SecureBootStatus > 0) && (PeInfo->SecuritySize == 0)) {
+		PrintDebug(L"  Skipping '%s': Not signed", Name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Pick the file system driver to load, among the variants we may have in
+ * \efi\rufus\ (e.g. 'ntfs_x64.efi', 'ntfs-3g_x64.efi'), by only looking at
+ * their PE headers. This avoids having LoadImage() read a whole driver, only
+ * for it to fail because it is for another architecture, is not a boot
+ * services driver, or cannot pass Secure Boot validation.
+ */
+static EFI_STATUS SelectDriver(CONST CHAR16* Name, CONST INTN SecureBootStatus, CHAR16* DriverPath)
+{
+	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE DirHandle = NULL;
+	EFI_FILE_INFO* FileInfo;
+	PE_INFO PeInfo;
+	CHAR16 Suffix[32], Path[PATH_MAX];
+	UINTN Size, Score, BestScore = 0;
+
+	// Use 'rufus' in the driver path, so that we don't accidentally latch onto a user driver
+	UnicodeSPrint(DriverPath, PATH_MAX, L"\\efi\\rufus\\%s_%s.efi", Name, Arch);
+	UnicodeSPrint(Suffix, ARRAY_SIZE(Suffix), L"_%s.efi", Arch);
+
+	// If we can't look at the drivers, let LoadImage() sort it out
+	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
+	if (FileInfo == NULL)
+		return EFI_SUCCESS;
+	if ((BootRoot == NULL) ||
+		(BootRoot->Open(BootRoot, &DirHandle, L"\\efi\\rufus", EFI_FILE_MODE_READ, 0) != EFI_SUCCESS)) {
+		FreePool(FileInfo);
+		return EFI_SUCCESS;
+	}
+
+	do {
+		Size = FileInfoSize;
+		ZeroMem(FileInfo, Size);
+		Status = DirHandle->Read(DirHandle, &Size, (VOID*)FileInfo);
+		if (EFI_ERROR(Status) || (Size == 0) || (FileInfo->Attribute & EFI_FILE_DIRECTORY) ||
+			!MatchName(FileInfo->FileName, Name, Suffix))
+			continue;
+		UnicodeSPrint(Path, ARRAY_SIZE(Path), L"\\efi\\rufus\\%s", FileInfo->FileName);
+		if (!IsUsableDriver(Path, FileInfo->FileName, SecureBootStatus, &PeInfo))
+			continue;
+		// Under Secure Boot, prefer drivers signed with a certificate that is trusted
+		// by default. Otherwise, prefer the driver with the default name.
+		Score = 1;
+		if ((SecureBootStatus > 0) && PeInfo.TrustedIssuer)
+			Score += 2;
+		if (_StriCmp(Path, DriverPath) == 0)
+			Score += 1;
+		if (Score > BestScore) {
+			BestScore = Score;
+			SafeStrCpy(DriverPath, PATH_MAX, Path);
+		}
+	} while ((Size != 0) && !EFI_ERROR(Status));
+
+	DirHandle->Close(DirHandle);
+	FreePool(FileInfo);
+	if (BestScore == 0)
+		return (SecureBootStatus > 0) ? EFI_SECURITY_VIOLATION : EFI_NOT_FOUND;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Load the driver for the target file system. A driver that is built into
+ * our binary is preferred, since it doesn't have to be read from the boot
+ * partition, and we fall back to the ones from '\efi\rufus\' otherwise.
+ */
+static EFI_STATUS LoadFileSystemDriver(CONST CHAR16* Name, CONST CHAR16* FsName, CONST EFI_HANDLE BootHandle,
+	CONST INTN SecureBootStatus, CHAR16* DriverPath, EFI_HANDLE* ImageHandle)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH* DevicePath;
+#if defined(EMBEDDED_DRIVER)
+	CONST VOID* Buffer;
+	UINTN Size;
+#endif
+
+#if defined(EMBEDDED_DRIVER)
+	if (GetEmbeddedDriver(Name, &Buffer, &Size)) {
+		// Use the path the driver would have on disk, so that the firmware
+		// applies the same Secure Boot policy as it would for that file.
+		UnicodeSPrint(DriverPath, PATH_MAX, L"\\efi\\rufus\\%s_%s.efi", Name, Arch);
+		DevicePath = FileDevicePath(BootHandle, DriverPath);
+		if (DevicePath != NULL) {
+			Status = gBS->LoadImage(FALSE, MainImageHandle, DevicePath, (VOID*)Buffer, Size, ImageHandle);
+			FreePool(DevicePath);
+			if (Status == EFI_SUCCESS) {
+				PrintDebug(L"  Using embedded driver (%d KB)", Size / 1024);
+				return EFI_SUCCESS;
+			}
+			PrintWarning(L"  Could not load embedded driver: %r", Status);
+		}
+	}
+#endif
+
+	Status = SelectDriver(Name, SecureBootStatus, DriverPath);
+	if (EFI_ERROR(Status)) {
+		PrintError(L"  No usable %s driver in '\\efi\\rufus\\'", FsName);
+		return Status;
+	}
+	PrintDebug(L"  Selected '%s'", &DriverPath[1]);
+	DevicePath = FileDevicePath(BootHandle, DriverPath);
+	if (DevicePath == NULL) {
+		PrintError(L"  Unable to set path for '%s'", DriverPath);
+		return EFI_DEVICE_ERROR;
+	}
+
+	// Attempt to load the driver.
+	// NB: If running in a Secure Boot enabled environment, LoadImage() will fail if
+	// the image being loaded does not pass the Secure Boot signature validation.
+	Status = gBS->LoadImage(FALSE, MainImageHandle, DevicePath, NULL, 0, ImageHandle);
+	SafeFree(DevicePath);
+	if (EFI_ERROR(Status)) {
+		// Some platforms (e.g. Intel NUCs) return EFI_ACCESS_DENIED for Secure Boot
+		// validation errors. Return a much more explicit EFI_SECURITY_VIOLATION then.
+		if ((Status == EFI_ACCESS_DENIED) && (SecureBootStatus >= 1))
+			Status = EFI_SECURITY_VIOLATION;
+		PrintError(L"  Unable to load driver '%s'", DriverPath);
+	}
+	return Status;
+}
+
+#if FEATURE_DRIVER_PACK
+/*
+ * Some older platforms only have firmware drivers for slow storage paths
+ * (EHCI, USB BOT), so we optionally load extra drivers, such as xHCI or UAS,
+ * from \efi\rufus\drivers\<arch>\ before we go looking for the target. UEFI
+ * drivers do not declare dependencies, so they are loaded in alphabetical
+ * order, which lets users order them by prefixing them with a number.
+ */
+#define MAX_PACK_DRIVERS    16
+
+/* Not all of the environments we build with provide this one */
+static EFI_GUID PciIoGuid =
+	{ 0x4cf5b200, 0x68b8, 0x4ca5, { 0x9e, 0xec, 0xb2, 0x3e, 0x3f, 0x50, 0x02, 0x9a } };
+
+/*
+ * Have the drivers we just loaded take over the boot disk, by reconnecting
+ * the controller it sits on, and everything below it. This invalidates the
+ * handle of our boot partition, as well as BootRoot, which we reopen.
+ * Returns EFI_UNSUPPORTED, with the boot partition left untouched, if the
+ * boot disk doesn't sit on a PCI controller (e.g. MMIO SD/eMMC or virtio).
+ * Any other error means that we lost the boot disk.
+ */
+static EFI_STATUS ReconnectBootController(EFI_HANDLE* BootHandle)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH *BootPath, *RemainingDevicePath;
+	EFI_HANDLE ControllerHandle, Handle;
+
+	// The device path of the current handle goes away with it, so we need a copy
+	BootPath = DuplicateDevicePath(DevicePathFromHandle(*BootHandle));
+	if (BootPath == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	RemainingDevicePath = BootPath;
+	Status = gBS->LocateDevicePath(&PciIoGuid, &RemainingDevicePath, &ControllerHandle);
+	if (EFI_ERROR(Status)) {
+		PrintWarning(L"  Boot disk is not on a PCI controller - drivers can't take it over");
+		Status = EFI_UNSUPPORTED;
+		goto out;
+	}
+
+	if (BootRoot != NULL) {
+		BootRoot->Close(BootRoot);
+		BootRoot = NULL;
+	}
+	gBS->DisconnectController(ControllerHandle, NULL, NULL);
+	gBS->ConnectController(ControllerHandle, NULL, NULL, TRUE);
+
+	// If the new drivers produced a different path to the boot disk, we can't follow it
+	RemainingDevicePath = BootPath;
+	Status = gBS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &RemainingDevicePath, &Handle);
+	if (!EFI_ERROR(Status) && !IsDevicePathEnd(RemainingDevicePath))
+		Status = EFI_NOT_FOUND;
+	if (EFI_ERROR(Status))
+		goto out;
+	*BootHandle = Handle;
+	Status = OpenRoot(Handle, &BootRoot);
+
+out:
+	FreePool(BootPath);
+	return Status;
+}
+
+static EFI_STATUS LoadDriverPack(EFI_HANDLE* BootHandle, CONST INTN SecureBootStatus)
+{
+	static CHAR16 Name[MAX_PACK_DRIVERS][PATH_MAX];
+	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE DirHandle;
+	EFI_FILE_INFO* FileInfo;
+	EFI_DEVICE_PATH* DevicePath;
+	EFI_HANDLE ImageHandle;
+	PE_INFO PeInfo;
+	CHAR16 Dir[64], Path[PATH_MAX];
+	UINTN i, Size, Count = 0, Started = 0;
+	UINT32 Throughput;
+
+	UnicodeSPrint(Dir, ARRAY_SIZE(Dir), L"\\efi\\rufus\\drivers\\%s", Arch);
+	if ((BootRoot == NULL) || (BootRoot->Open(BootRoot, &DirHandle, Dir, EFI_FILE_MODE_READ, 0) != EFI_SUCCESS))
+		return EFI_SUCCESS;
+	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
+	if (FileInfo == NULL) {
+		DirHandle->Close(DirHandle);
+		return EFI_SUCCESS;
+	}
+
+	// Sort the drivers by name as we read them
+	do {
+		Size = FileInfoSize;
+		Status = DirHandle->Read(DirHandle, &Size, (VOID*)FileInfo);
+		if (EFI_ERROR(Status) || (Size == 0) || (FileInfo->Attribute & EFI_FILE_DIRECTORY) ||
+			!MatchName(FileInfo->FileName, L"", L".efi"))
+			continue;
+		if (Count >= MAX_PACK_DRIVERS) {
+			PrintWarning(L"  Too many drivers in '%s' - ignoring '%s'", Dir, FileInfo->FileName);
+			continue;
+		}
+		for (i = Count; (i > 0) && (_StriCmp(FileInfo->FileName, Name[i - 1]) < 0); i--)
+			CopyMem(Name[i], Name[i - 1], sizeof(Name[i]));
+		SafeStrCpy(Name[i], PATH_MAX, FileInfo->FileName);
+		Count++;
+	} while ((Size != 0) && !EFI_ERROR(Status));
+	DirHandle->Close(DirHandle);
+	FreePool(FileInfo);
+	if (Count == 0)
+		return EFI_SUCCESS;
+
+	PrintInfo(L"Loading extra drivers from '%s':", &Dir[1]);
+	Throughput = MeasureThroughput(*BootHandle, &IoProfile);
+	for (i = 0; i < Count; i++) {
+		UnicodeSPrint(Path, ARRAY_SIZE(Path), L"%s\\%s", Dir, Name[i]);
+		if (!IsUsableDriver(Path, Name[i], SecureBootStatus, &PeInfo))
+			continue;
+		DevicePath = FileDevicePath(*BootHandle, Path);
+		if (DevicePath == NULL)
+			continue;
+		Status = gBS->LoadImage(FALSE, MainImageHandle, DevicePath, NULL, 0, &ImageHandle);
+		SafeFree(DevicePath);
+		if (EFI_ERROR(Status)) {
+			PrintWarning(L"  Could not load '%s': %r", Name[i], Status);
+			continue;
+		}
+		Status = gBS->StartImage(ImageHandle, NULL, NULL);
+		if (EFI_ERROR(Status)) {
+			PrintWarning(L"  Could not start '%s': %r", Name[i], Status);
+			continue;
+		}
+		PrintInfo(L"  %s (%s)", GetDriverName(ImageHandle), Name[i]);
+		Started++;
+	}
+	if (Started == 0)
+		return EFI_SUCCESS;
+
+	Status = ReconnectBootController(BootHandle);
+	// Nothing was disconnected then, so we can carry on with the boot disk we have
+	if (Status == EFI_UNSUPPORTED)
+		return EFI_SUCCESS;
+	if (EFI_ERROR(Status))
+		return Status;
+	GetIoProfile(*BootHandle, &IoProfile);
+	PrintInfo(L"  Boot disk throughput: %d KB/s before, %d KB/s after (%s)", Throughput,
+		MeasureThroughput(*BootHandle, &IoProfile), GetTransportName(IoProfile.Transport));
+	return EFI_SUCCESS;
+}
+#endif
+
+
 /*
  * Some UEFI firmwares (like HPQ EFI from HP notebooks) have DiskIo protocols
  * opened BY_DRIVER (by Partition driver in HP's case) even when no file system
@@ -81,12 +481,17 @@ static CHAR16* GetDriverName(CONST EFI_HANDLE DriverHandle)
  * This code was originally derived from similar BSD-3-Clause licensed one
  * (a.k.a. Modified BSD License, which can be used in GPLv2+ works), found at:
  * https://sourceforge.net/p/cloverefiboot/code/3294/tree/rEFIt_UEFI/refit/main.c#l1271
+ *
+ * Since the target partition must reside on the boot disk, we only look at
+ * partitions from that disk.
+ *
+ * Returns the number of drivers that were disconnected.
  */
-static VOID DisconnectBlockingDrivers(VOID) {
+static UINTN DisconnectBlockingDrivers(CONST DEVICE_PATH_VIEW* BootDisk) {
 	EFI_STATUS Status;
-	UINTN HandleCount = 0, Index, OpenInfoIndex, OpenInfoCount;
+	UINTN HandleCount = 0, Index, OpenInfoIndex, OpenInfoCount, Disconnected = 0;
 	EFI_HANDLE *Handles = NULL;
-	CHAR16 *DevicePathString;
+	DEVICE_PATH_VIEW Partition;
 	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Volume;
 	EFI_BLOCK_IO_PROTOCOL *BlockIo;
 	EFI_OPEN_PROTOCOL_INFORMATION_ENTRY *OpenInfo;
@@ -94,7 +499,7 @@ static VOID DisconnectBlockingDrivers(VOID) {
 	// Get all DiskIo handles
 	Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiDiskIoProtocolGuid, NULL, &HandleCount, &Handles);
 	if (EFI_ERROR(Status) || (HandleCount == 0))
-		return;
+		return 0;
 
 	// Check every DiskIo handle
 	for (Index = 0; Index < HandleCount; Index++) {
@@ -110,20 +515,27 @@ static VOID DisconnectBlockingDrivers(VOID) {
 		if ((BlockIo->Media == NULL) || (!BlockIo->Media->LogicalPartition))
 			continue;
 
+		// Same as for the target partition search, QEMU testing uses a separate disk
+#if !defined(_DEBUG)
+		InitDevicePathView(&Partition, DevicePathFromHandle(Handles[Index]));
+		if (!IsParentDevicePath(BootDisk, &Partition))
+			continue;
+#else
+		(VOID)Partition;
+#endif
+
 		// If SimpleFileSystem is already produced - skip it, this is ok
 		Status = gBS->OpenProtocol(Handles[Index], &gEfiSimpleFileSystemProtocolGuid, (VOID**)&Volume,
 			MainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
 		if (Status == EFI_SUCCESS)
 			continue;
 
-		DevicePathString = DevicePathToString(DevicePathFromHandle(Handles[Index]));
-
 		// If no SimpleFileSystem on this handle but DiskIo is opened BY_DRIVER
 		// then disconnect this connection
 		Status = gBS->OpenProtocolInformation(Handles[Index], &gEfiDiskIoProtocolGuid, &OpenInfo, &OpenInfoCount);
 		if (EFI_ERROR(Status)) {
-			PrintWarning(L"  Could not get DiskIo protocol for %s: %r", DevicePathString, Status);
-			FreePool(DevicePathString);
+			PrintWarningPath(DevicePathFromHandle(Handles[Index]),
+				L"  Could not get DiskIo protocol (%r) for %s", Status);
 			continue;
 		}
 
@@ -131,18 +543,19 @@ static VOID DisconnectBlockingDrivers(VOID) {
 			if ((OpenInfo[OpenInfoIndex].Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) == EFI_OPEN_PROTOCOL_BY_DRIVER) {
 				Status = gBS->DisconnectController(Handles[Index], OpenInfo[OpenInfoIndex].AgentHandle, NULL);
 				if (EFI_ERROR(Status)) {
-					PrintError(L"  Could not disconnect '%s' on %s",
-						GetDriverName(OpenInfo[OpenInfoIndex].AgentHandle), DevicePathString);
+					PrintErrorPath(DevicePathFromHandle(Handles[Index]), L"  Could not disconnect '%s' on %s",
+						GetDriverName(OpenInfo[OpenInfoIndex].AgentHandle));
 				} else {
-					PrintWarning(L"  Disconnected '%s' on %s ",
-						GetDriverName(OpenInfo[OpenInfoIndex].AgentHandle), DevicePathString);
+					PrintWarningPath(DevicePathFromHandle(Handles[Index]), L"  Disconnected '%s' on %s ",
+						GetDriverName(OpenInfo[OpenInfoIndex].AgentHandle));
+					Disconnected++;
 				}
 			}
 		}
-		FreePool(DevicePathString);
 		FreePool(OpenInfo);
 	}
 	FreePool(Handles);
+	return Disconnected;
 }
 
 /*
@@ -186,6 +599,284 @@ EFI_STATUS UnloadDriver(
 	return EFI_NOT_FOUND;
 }
 
+/*
+ * Look for the NTFS/exFAT partition that resides on the same disk as the
+ * partition we booted from.
+ * Returns the handle of the target partition and sets FsType, or returns
+ * NULL if no target partition could be found.
+ */
+static EFI_HANDLE FindTargetPartition(CONST DEVICE_PATH_VIEW* BootPartition,
+	CONST DEVICE_PATH_VIEW* BootDisk, UINTN* FsType)
+{
+	CONST CHAR8 FsMagic[2][8] = {
+		{ 'N', 'T', 'F', 'S', ' ', ' ', ' ', ' '} ,
+		{ 'E', 'X', 'F', 'A', 'T', ' ', ' ', ' '} };
+	EFI_STATUS Status;
+	DEVICE_PATH_VIEW Partition;
+	EFI_HANDLE *Handles = NULL, TargetHandle = NULL;
+	EFI_BLOCK_IO_PROTOCOL *BlockIo;
+	CHAR8* Buffer;
+	UINTN Index, HandleCount = 0;
+	UINT32 Alignment;
+	BOOLEAN SameDevice;
+
+	// Enumerate all disk handles
+	Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiDiskIoProtocolGuid,
+		NULL, &HandleCount, &Handles);
+	if (EFI_ERROR(Status)) {
+		PrintError(L"  Failed to list disks");
+		return NULL;
+	}
+
+	// Go through the partitions and find the one that has the USB Disk we booted from
+	// as parent and that isn't the FAT32 boot partition
+	for (Index = 0; Index < HandleCount; Index++) {
+		// Note: The Device Path obtained from DevicePathFromHandle() should NOT be freed!
+		InitDevicePathView(&Partition, DevicePathFromHandle(Handles[Index]));
+		// Eliminate the partition we booted from
+		if (IsSameDevicePath(&Partition, BootPartition))
+			continue;
+		// Ensure that we look for the NTFS/exFAT partition on the same device.
+		SameDevice = IsParentDevicePath(BootDisk, &Partition);
+		// The check breaks QEMU testing (since we can't easily emulate
+		// a multipart device on the fly) so only do it for release.
+#if !defined(_DEBUG)
+		if (!SameDevice)
+			continue;
+#else
+		(VOID)SameDevice;	// Silence a MinGW warning
+#endif
+		// Read the first block of the partition and look for the FS magic in the OEM ID
+		Status = gBS->OpenProtocol(Handles[Index], &gEfiBlockIoProtocolGuid,
+			(VOID**)&BlockIo, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+		if (EFI_ERROR(Status))
+			continue;
+		// Some controllers reject reads into buffers that don't match their IoAlign
+		Alignment = (BlockIo->Media->IoAlign > IoProfile.Alignment) ? BlockIo->Media->IoAlign : IoProfile.Alignment;
+		Buffer = (CHAR8*)AllocateIoBuffer(BlockIo->Media->BlockSize, Alignment);
+		if (Buffer == NULL)
+			continue;
+		Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, 0, BlockIo->Media->BlockSize, Buffer);
+		for (*FsType = 0; (*FsType < ARRAY_SIZE(FsMagic)) &&
+			(CompareMem(&Buffer[3], FsMagic[*FsType], sizeof(FsMagic[*FsType])) != 0); (*FsType)++);
+		FreeIoBuffer(Buffer, BlockIo->Media->BlockSize, Alignment);
+		if (EFI_ERROR(Status))
+			continue;
+		if (*FsType < ARRAY_SIZE(FsMagic)) {
+			TargetHandle = Handles[Index];
+			break;
+		}
+	}
+
+	FreePool(Handles);
+	return TargetHandle;
+}
+
+/*
+ * With "Fast Boot" enabled, many firmwares only connect the partition they
+ * boot from, in which case the sibling partitions we are after don't have a
+ * handle. To produce them, we walk the boot disk's device path, connecting
+ * only the controllers that are needed to reach the disk, and then have the
+ * partition driver enumerate all of the disk's partitions.
+ * All connections are non recursive, so that we don't pay for the firmware
+ * connecting devices and file systems we have no use for.
+ */
+static EFI_STATUS ConnectBootDisk(CONST DEVICE_PATH_VIEW* BootDisk)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH *RemainingDevicePath;
+	EFI_HANDLE DiskHandle, PreviousHandle = NULL, *Handles = NULL;
+	DEVICE_PATH_VIEW Partition;
+	EFI_DISK_IO_PROTOCOL *DiskIo;
+	UINTN Index, HandleCount = 0;
+
+	if (BootDisk->DevicePath == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	// Connect each controller on the path, so that it produces the next node only
+	for (;;) {
+		RemainingDevicePath = (EFI_DEVICE_PATH*)BootDisk->DevicePath;
+		Status = gBS->LocateDevicePath(&gEfiDevicePathProtocolGuid, &RemainingDevicePath, &DiskHandle);
+		if (EFI_ERROR(Status))
+			return Status;
+		if (IsDevicePathEnd(RemainingDevicePath))
+			break;
+		// If the last connection did not get us further, there's nothing more we can do
+		if (DiskHandle == PreviousHandle)
+			return EFI_NOT_FOUND;
+		PreviousHandle = DiskHandle;
+		gBS->ConnectController(DiskHandle, NULL, RemainingDevicePath, FALSE);
+	}
+
+	// A NULL RemainingDevicePath has the partition driver produce all the partitions.
+	// Note that the partition driver supports being started again on a disk for which
+	// it only produced some of the partitions.
+	Status = gBS->ConnectController(DiskHandle, NULL, NULL, FALSE);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	// Since we are not recursive, the new partitions don't have DiskIo yet
+	Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &HandleCount, &Handles);
+	if (EFI_ERROR(Status))
+		return Status;
+	for (Index = 0; Index < HandleCount; Index++) {
+		if (gBS->HandleProtocol(Handles[Index], &gEfiDiskIoProtocolGuid, (VOID**)&DiskIo) == EFI_SUCCESS)
+			continue;
+		InitDevicePathView(&Partition, DevicePathFromHandle(Handles[Index]));
+		if (IsParentDevicePath(BootDisk, &Partition))
+			gBS->ConnectController(Handles[Index], NULL, NULL, FALSE);
+	}
+	FreePool(Handles);
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * On some xHCI firmwares, the sibling partitions of the boot partition only
+ * appear a few hundred milliseconds after we are started. Rather than wait
+ * for a fixed delay, have the firmware notify us of new BlockIo and DiskIo
+ * instances, and look for the target as they appear, until Timeout expires.
+ */
+static EFI_HANDLE WaitForTargetPartition(CONST DEVICE_PATH_VIEW* BootPartition,
+	CONST DEVICE_PATH_VIEW* BootDisk, UINTN* FsType, CONST UINTN Timeout)
+{
+	EFI_EVENT Events[2];
+	EFI_HANDLE Handle, TargetHandle = NULL;
+	EFI_DISK_IO_PROTOCOL* DiskIo;
+	DEVICE_PATH_VIEW View;
+	VOID *BlockIoRegistration, *DiskIoRegistration;
+	UINTN Index, Size, Elapsed;
+	UINT64 Start = GetElapsedTime();
+
+	Events[0] = Events[1] = NULL;
+	if ((gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &Events[0]) != EFI_SUCCESS) ||
+		(gBS->CreateEvent(EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Events[1]) != EFI_SUCCESS) ||
+		(gBS->RegisterProtocolNotify(&gEfiBlockIoProtocolGuid, Events[0], &BlockIoRegistration) != EFI_SUCCESS) ||
+		(gBS->RegisterProtocolNotify(&gEfiDiskIoProtocolGuid, Events[0], &DiskIoRegistration) != EFI_SUCCESS)) {
+		PrintWarning(L"  Could not register for new disk notifications");
+		goto out;
+	}
+	PrintWarning(L"  Waiting up to %d ms for target partition to appear...", Timeout);
+#if FEATURE_PREFLIGHT
+	// The firmware keeps enumerating the disk while we read the variables we'll need later
+	ReadSecureBootDatabases();
+#endif
+
+	// Partitions may have appeared before we registered, so always start with a scan
+	while ((TargetHandle = FindTargetPartition(BootPartition, BootDisk, FsType)) == NULL) {
+		Elapsed = (UINTN)(GetElapsedTime() - Start);
+		if ((Elapsed >= Timeout) ||
+			(gBS->SetTimer(Events[1], TimerRelative, (Timeout - Elapsed) * 10000) != EFI_SUCCESS) ||
+			(gBS->WaitForEvent(ARRAY_SIZE(Events), Events, &Index) != EFI_SUCCESS) || (Index != 0))
+			break;
+		// Have the new instances of the boot disk produce their partitions and DiskIo
+		for (;;) {
+			Size = sizeof(Handle);
+			if (gBS->LocateHandle(ByRegisterNotify, NULL, BlockIoRegistration, &Size, &Handle) != EFI_SUCCESS)
+				break;
+			InitDevicePathView(&View, DevicePathFromHandle(Handle));
+			if ((IsSameDevicePath(&View, BootDisk) || IsParentDevicePath(BootDisk, &View)) &&
+				(gBS->HandleProtocol(Handle, &gEfiDiskIoProtocolGuid, (VOID**)&DiskIo) != EFI_SUCCESS))
+				gBS->ConnectController(Handle, NULL, NULL, FALSE);
+		}
+	}
+	if (TargetHandle != NULL)
+		PrintInfo(L"  Target partition appeared after %d ms", (UINTN)(GetElapsedTime() - Start));
+
+out:
+	// Closing the event also cancels the notifications it was registered for
+	for (Index = 0; Index < ARRAY_SIZE(Events); Index++) {
+		if (Events[Index] != NULL)
+			gBS->CloseEvent(Events[Index]);
+	}
+	return TargetHandle;
+}
+
+/*
+ * Bind our file system driver, and only our driver, to the target partition.
+ * This is where the driver mounts the volume, which, for NTFS, may include
+ * replaying the journal, so we time it separately from the driver load.
+ */
+static EFI_STATUS ConnectFileSystemDriver(CONST EFI_HANDLE TargetHandle, CONST EFI_HANDLE DriverImageHandle)
+{
+	EFI_STATUS Status;
+	EFI_HANDLE DriverHandleList[2];
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume;
+
+	// Calling ConnectController() on a handle, with a NULL-terminated list of
+	// drivers will start all the drivers from the list that can service it.
+	// We don't use recursion, as there is nothing below a file system that we
+	// need, and we don't want other drivers to attempt binding to children.
+	DriverHandleList[0] = DriverImageHandle;
+	DriverHandleList[1] = NULL;
+#if FEATURE_READONLY
+	// Our filters and caches may already be in place if this is a retry
+	Status = StartReadOnlyFilter(TargetHandle);
+	if (EFI_ERROR(Status) && (Status != EFI_ALREADY_STARTED))
+		PrintWarning(L"  Could not make target partition read-only");
+#endif
+#if FEATURE_METADATA_CACHE
+	// The driver must mount the volume through our cache, so it goes in first
+	StartMetadataCache(TargetHandle);
+#endif
+#if FEATURE_TRACE
+	Status = StartTrace(TargetHandle);
+	if (EFI_ERROR(Status) && (Status != EFI_ALREADY_STARTED))
+		PrintWarning(L"  Could not start disk trace");
+#endif
+	StartPhase(PHASE_CONNECT);
+	Status = gBS->ConnectController(TargetHandle, DriverHandleList, NULL, FALSE);
+	EndPhase(PHASE_CONNECT);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	// Make sure that the driver did produce a file system. If it didn't, we
+	// still let the caller wait for it, as some drivers are slow to do so.
+	Status = gBS->OpenProtocol(TargetHandle, &gEfiSimpleFileSystemProtocolGuid,
+		(VOID**)&Volume, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_TEST_PROTOCOL);
+	if (EFI_ERROR(Status))
+		PrintWarning(L"  Driver did not produce a file system (yet)");
+	else
+		PrintDebug(L"  Volume mounted in %d ms", GetPhaseTime(PHASE_CONNECT));
+#if FEATURE_READONLY
+	ReportReadOnlyFilter();
+	// Writes from here on would be lost when we exit, so they must fail
+	LockReadOnlyFilter();
+#endif
+
+	if (GetPhaseTime(PHASE_CONNECT) >= MOUNT_WARN_TIME) {
+		PrintWarning(L"  Mounting took %d ms, which usually means that the volume was not", GetPhaseTime(PHASE_CONNECT));
+		PrintWarning(L"  cleanly unmounted. You may want to run 'chkdsk /f' on it from Windows.");
+	}
+
+	return EFI_SUCCESS;
+}
+
+#if FEATURE_VOLUME_LABEL
+/* Display the label of a volume */
+static VOID PrintVolumeLabel(CONST EFI_FILE_HANDLE Root)
+{
+	EFI_STATUS Status;
+	EFI_FILE_SYSTEM_VOLUME_LABEL* VolumeInfo;
+	UINTN Size = FILE_INFO_SIZE;
+
+	VolumeInfo = (EFI_FILE_SYSTEM_VOLUME_LABEL*)AllocateZeroPool(Size);
+	if (VolumeInfo == NULL)
+		return;
+	Status = Root->GetInfo(Root, &gEfiFileSystemVolumeLabelInfoIdGuid, &Size, VolumeInfo);
+	// Some UEFI firmwares return EFI_BUFFER_TOO_SMALL, even with
+	// a large enough buffer, unless the exact size is requested.
+	if ((Status == EFI_BUFFER_TOO_SMALL) && (Size <= FILE_INFO_SIZE))
+		Status = Root->GetInfo(Root, &gEfiFileSystemVolumeLabelInfoIdGuid, &Size, VolumeInfo);
+	if (Status == EFI_SUCCESS)
+		PrintInfo(L"  Volume label is '%s'", VolumeInfo->VolumeLabel);
+	else
+		PrintWarning(L"  Could not read volume label: [%d] %r\n", (Status & 0x7FFFFFFF), Status);
+	FreePool(VolumeInfo);
+}
+#endif
+
+#if FEATURE_BANNER
 /*
  * Display a centered application banner
  */
@@ -231,6 +922,213 @@ static VOID DisplayBanner(VOID)
 	Print(L"%c\n\n", BOXDRAW_UP_LEFT);
 	DefText();
 }
+#endif
+
+/*
+ * Record how long each phase took, then write the log to the boot volume.
+ */
+static VOID WriteBootLog(VOID)
+{
+	static CONST CHAR16* PhaseName[PHASE_MAX] = { L"Disconnect", L"Scan", L"Driver", L"Connect", L"Open", L"Loader" };
+	UINTN Phase;
+
+	for (Phase = 0; Phase < PHASE_MAX; Phase++)
+		PrintDebug(L"%s phase: %d ms", PhaseName[Phase], GetPhaseTime((BOOT_PHASE)Phase));
+	PrintDebug(L"Total time: %d ms", (UINT32)GetElapsedTime());
+
+#if FEATURE_LOG_FILE
+	if (BootRoot != NULL)
+		SaveLog(BootRoot);
+#endif
+#if FEATURE_TRACE
+	if (BootRoot != NULL)
+		SaveTrace(BootRoot);
+#endif
+}
+
+/*
+ * Load a bootloader, from our cache if we already read it, and start it.
+ * This only returns if the bootloader failed to load or returned.
+ */
+static EFI_STATUS StartLoader(CONST EFI_HANDLE TargetHandle, CONST EFI_FILE_HANDLE Root,
+	CONST UINTN Index, CONST INTN SecureBootStatus)
+{
+	// We'll search for "bootmgr.dll" in UEFI bootloaders to identify Windows
+	// bootloaders, but we don't want to match our own bootloader in the process.
+	// So we use a modifiable string buffer where the first character is not set.
+	CHAR8 BootMgrName[] = "_ootmgr.dll", BootMgrNameFirstLetter = 'b';
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH* DevicePath;
+	EFI_HANDLE ImageHandle;
+	EFI_LOADED_IMAGE_PROTOCOL* LoadedImage;
+	BOOLEAN WindowsBootMgr = FALSE;
+	UINTN i;
+
+	PrintInfo(L"Launching '%s'...", &LoaderPath[Index][1]);
+	StartPhase(PHASE_LOADER);
+
+	if (LoaderImage[Index] == NULL) {
+		Status = ReadWholeFile(Root, LoaderPath[Index], &LoaderImage[Index], &LoaderImageSize[Index],
+			&LoaderIdentity[Index]);
+		if (EFI_ERROR(Status)) {
+			EndPhase(PHASE_LOADER);
+			PrintError(L"  Could not read bootloader");
+			return Status;
+		}
+	}
+
+#if FEATURE_PREFLIGHT
+	// Under Secure Boot, find out right away if the bootloader is going to be rejected
+	if (SecureBootStatus > 0) {
+		Status = CheckRevocation(LoaderImage[Index], LoaderImageSize[Index], &LoaderIdentity[Index]);
+		if (Status == EFI_SECURITY_VIOLATION) {
+			EndPhase(PHASE_LOADER);
+			PrintError(L"  Bootloader would be rejected by Secure Boot");
+			return Status;
+		}
+	}
+#endif
+
+	// Now attempt to chain load the bootloader. We still provide its device path,
+	// so that it can locate the rest of its files on the target partition.
+	DevicePath = FileDevicePath(TargetHandle, LoaderPath[Index]);
+	if (DevicePath == NULL) {
+		EndPhase(PHASE_LOADER);
+		Status = EFI_DEVICE_ERROR;
+		PrintError(L"  Could not create path");
+		return Status;
+	}
+	Status = gBS->LoadImage(FALSE, MainImageHandle, DevicePath,
+		LoaderImage[Index], LoaderImageSize[Index], &ImageHandle);
+	SafeFree(DevicePath);
+	EndPhase(PHASE_LOADER);
+	if (EFI_ERROR(Status)) {
+		if ((Status == EFI_ACCESS_DENIED) && (SecureBootStatus >= 1))
+			Status = EFI_SECURITY_VIOLATION;
+		PrintError(L"  Load failure");
+		return Status;
+	}
+	ReportMemoryUsage(L"after loader load");
+
+	// Look for a "bootmgr.dll" string in the loaded image to identify a Windows bootloader.
+	BootMgrName[0] = BootMgrNameFirstLetter;
+	Status = gBS->OpenProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid,
+		(VOID**)&LoadedImage, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (EFI_ERROR(Status)) {
+		PrintWarning(L"  Unable to inspect loaded executable");
+	} else for (i = 0x40; i < LoadedImage->ImageSize - sizeof(BootMgrName); i++) {
+		if (CompareMem((CHAR8*)((UINTN)LoadedImage->ImageBase + i),
+			BootMgrName, sizeof(BootMgrName)) == 0) {
+			WindowsBootMgr = TRUE;
+			PrintInfo(L"Starting Microsoft Windows bootmgr...");
+			break;
+		}
+	}
+
+	// Windows install media spend most of their boot time reading their RAM disk,
+	// which we can speed up a lot on USB, by reading it ahead in large chunks.
+#if FEATURE_READAHEAD
+	if (WindowsBootMgr && IS_USB_TRANSPORT(IoProfile.Transport))
+		StartReadAhead(TargetHandle, Root, &IoProfile);
+#endif
+
+	// The loader may never return, so this is where we record a successful boot.
+	// A relaunch is the same boot, so it must not cost us another set of writes.
+	if (!BootRecorded) {
+		BootRecorded = TRUE;
+		SaveProfile(BootRoot, &Profile, TRUE);
+#if FEATURE_PREFLIGHT
+		SaveDigestCache(BootRoot);
+#endif
+#if FEATURE_TELEMETRY
+		PublishTelemetry(LoaderPath[Index], SecureBootStatus, Profile.Flags, &IoProfile);
+#endif
+		WriteBootLog();
+	}
+
+	Status = gBS->StartImage(ImageHandle, NULL, NULL);
+	if (EFI_ERROR(Status)) {
+		// Windows bootmgr simply returns EFI_NO_MAPPING on any internal error or security
+		// violation, instead of halting and explicitly reporting the issue, leaving many
+		// users extremely confused as to why their media did not boot. This can happen, for
+		// instance, if the machine has had the BlackLotus UEFI lock enabled and the user
+		// attempts to boot a pre 2023.05 version of the Windows installers.
+		// We therefore take it upon ourselves to report what Windows bootmgr will not report.
+		if (Status == EFI_NO_MAPPING && WindowsBootMgr) {
+			PrintLog(LOG_ERROR, L"  Windows bootmgr encountered a security validation or internal error");
+		} else
+			PrintError(L"  Start failure");
+	} else {
+		PrintInfo(L"'%s' exited", &LoaderPath[Index][1]);
+	}
+	return Status;
+}
+
+/*
+ * Once a bootloader has returned, offer to relaunch it or to launch the next
+ * one we can find, since everything is already set up for it. This is a lot
+ * faster than having the firmware restart the whole process from scratch.
+ * A bootloader that Secure Boot rejected will be rejected again, so we don't
+ * offer to relaunch it. Without a keystroke, we exit after RELAUNCH_TIMEOUT,
+ * so that unattended systems can proceed to their next boot option.
+ * Returns FALSE if the user chose to exit, or if there is nothing to launch.
+ */
+static BOOLEAN PromptRelaunch(CONST EFI_FILE_HANDLE Root, UINTN* Index, CONST EFI_STATUS LastStatus)
+{
+	EFI_INPUT_KEY Key;
+	EFI_EVENT Events[2];
+	UINTN Event, Next = 0;
+	BOOLEAN CanRelaunch = (LastStatus != EFI_SECURITY_VIOLATION), HasNext = FALSE, Relaunch = FALSE;
+
+	// Look for the next candidate, wrapping around
+	if ((*Index + 1 < LoaderCount) &&
+		(FindFirstPath(Root, &LoaderPath[*Index + 1], LoaderCount - *Index - 1, &Next) == EFI_SUCCESS)) {
+		Next += *Index + 1;
+		HasNext = TRUE;
+	} else if ((*Index > 0) && (FindFirstPath(Root, LoaderPath, *Index, &Next) == EFI_SUCCESS)) {
+		HasNext = TRUE;
+	}
+
+	if (!CanRelaunch && !HasNext)
+		return FALSE;
+	Events[0] = gST->ConIn->WaitForKey;
+	if (gBS->CreateEvent(EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Events[1]) != EFI_SUCCESS)
+		return FALSE;
+
+	SetText(TEXT_YELLOW);
+	Print(L"\n");
+	if (CanRelaunch)
+		Print(L"[R]   Relaunch '%s'\n", &LoaderPath[*Index][1]);
+	if (HasNext)
+		Print(L"[N]   Launch '%s'\n", &LoaderPath[Next][1]);
+	Print(L"[Esc] Exit (default, in %d seconds)\n", RELAUNCH_TIMEOUT);
+	DefText();
+
+	gST->ConIn->Reset(gST->ConIn, FALSE);
+	if (gBS->SetTimer(Events[1], TimerRelative, RELAUNCH_TIMEOUT * 10000000ULL) != EFI_SUCCESS)
+		goto out;
+	while (TRUE) {
+		if ((gBS->WaitForEvent(ARRAY_SIZE(Events), Events, &Event) != EFI_SUCCESS) || (Event != 0))
+			break;
+		if (gST->ConIn->ReadKeyStroke(gST->ConIn, &Key) != EFI_SUCCESS)
+			continue;
+		if (Key.ScanCode == SCAN_ESC)
+			break;
+		if (CanRelaunch && ((Key.UnicodeChar == L'r') || (Key.UnicodeChar == L'R'))) {
+			Relaunch = TRUE;
+			break;
+		}
+		if (HasNext && ((Key.UnicodeChar == L'n') || (Key.UnicodeChar == L'N'))) {
+			*Index = Next;
+			Relaunch = TRUE;
+			break;
+		}
+	}
+
+out:
+	gBS->CloseEvent(Events[1]);
+	return Relaunch;
+}
 
 /*
  * Application entry-point
@@ -238,50 +1136,27 @@ static VOID DisplayBanner(VOID)
  */
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE BaseImageHandle, EFI_SYSTEM_TABLE *SystemTable)
 {
-	CONST CHAR8 FsMagic[2][8] = {
-		{ 'N', 'T', 'F', 'S', ' ', ' ', ' ', ' '} ,
-		{ 'E', 'X', 'F', 'A', 'T', ' ', ' ', ' '} };
 	CONST CHAR16* FsName[] = { L"NTFS", L"exFAT" };
 	CONST CHAR16* DriverName[] = { L"ntfs", L"exfat" };
-	CHAR16 DriverPath[64], LoaderPath[64];
-	CHAR16* DevicePathString;
+	CHAR16 DriverPath[PATH_MAX];
 	EFI_LOADED_IMAGE_PROTOCOL *LoadedImage;
 	EFI_STATUS Status;
-	EFI_DEVICE_PATH *DevicePath = NULL, *ParentDevicePath = NULL, *BootDiskPath = NULL;
+	EFI_DEVICE_PATH *BootDiskPath = NULL;
 	EFI_DEVICE_PATH *BootPartitionPath = NULL;
-	EFI_HANDLE* Handles = NULL, ImageHandle, DriverHandleList[2] = { 0 };
+	DEVICE_PATH_VIEW BootPartition, BootDisk;
+	EFI_HANDLE BootHandle, TargetHandle, ImageHandle;
 	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume;
-	EFI_FILE_SYSTEM_VOLUME_LABEL* VolumeInfo;
 	EFI_FILE_HANDLE Root;
-	EFI_BLOCK_IO_PROTOCOL *BlockIo;
-	// We'll search for "bootmgr.dll" in UEFI bootloaders to identify Windows
-	// bootloaders, but we don't want to match our own bootloader in the process.
-	// So we use a modifiable string buffer where the first character is not set.
-	CHAR8 BootMgrName[] = "_ootmgr.dll", BootMgrNameFirstLetter = 'b';
-	CHAR8* Buffer;
 	INTN SecureBootStatus;
-	UINTN Index, FsType = 0, Try, Event, HandleCount = 0, Size;
-	BOOLEAN SameDevice, WindowsBootMgr = FALSE;
+	UINTN Index, FsType = 0, Event;
+	UINT32 Waited;
+	BOOLEAN Prompted = FALSE;
 
 #if defined(_GNU_EFI)
 	InitializeLib(BaseImageHandle, SystemTable);
 #endif
 	MainImageHandle = BaseImageHandle;
-
-	DisplayBanner();
-	PrintSystemInfo();
-	SecureBootStatus = GetSecureBootStatus();
-	SetText(TEXT_WHITE);
-	Print(L"[INFO]");
-	DefText();
-	Print(L" Secure Boot status: ");
-	if (SecureBootStatus == 0) {
-		Print(L"Disabled\n");
-	} else {
-		SetText((SecureBootStatus > 0) ? TEXT_WHITE : TEXT_YELLOW);
-		Print(L"%s\n", (SecureBootStatus > 0) ? L"Enabled" : L"Setup");
-		DefText();
-	}
+	InitTimer();
 
 	Status = gBS->OpenProtocol(MainImageHandle, &gEfiLoadedImageProtocolGuid,
 		(VOID**)&LoadedImage, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
@@ -289,77 +1164,96 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE BaseImageHandle, EFI_SYSTEM_TABLE *SystemT
 		PrintError(L"Unable to access boot image interface");
 		goto out;
 	}
+	// Must be done before we print anything
+	SetLogLevel(LoadedImage->LoadOptions, LoadedImage->LoadOptionsSize);
+	BootHandle = LoadedImage->DeviceHandle;
 
-	PrintInfo(L"Disconnecting potentially blocking drivers");
-	DisconnectBlockingDrivers();
+#if FEATURE_BANNER
+	DisplayBanner();
+#endif
+	SecureBootStatus = GetSecureBootStatus();
+#if FEATURE_SYSTEM_INFO
+	PrintSystemInfo();
+	if (SecureBootStatus >= 0)
+		PrintInfo(L"Secure Boot status: %s", (SecureBootStatus > 0) ? L"Enabled" : L"Disabled");
+	else
+		PrintWarning(L"Secure Boot status: Setup");
+	PrintPlatformState();
+#endif
+	PrintDebug(L"Image size: %d KB", (UINTN)DIV_U64(LoadedImage->ImageSize, 1024));
+	ReportMemoryUsage(L"at start");
 
-	// Identify our boot partition and disk
-	BootPartitionPath = DevicePathFromHandle(LoadedImage->DeviceHandle);
-	BootDiskPath = GetParentDevice(BootPartitionPath);
+	// Look up the settings that worked the last time we booted on this platform, from this media
+	if (OpenRoot(BootHandle, &BootRoot) == EFI_SUCCESS) {
+		if (LoadProfile(BootRoot, DevicePathFromHandle(BootHandle), &Profile) == EFI_SUCCESS)
+			PrintDebug(L"Using boot profile %016lx (%d previous boot(s))", Profile.Key, Profile.Boots);
+#if FEATURE_PREFLIGHT
+		// The digests of the bootloaders we verified are only needed under Secure Boot
+		if (SecureBootStatus > 0)
+			LoadDigestCache(BootRoot);
+#endif
+	} else {
+		PrintWarning(L"Could not access boot volume - boot profiles are disabled");
+	}
 
-	PrintInfo(L"Searching for target partition on boot disk:");
-	DevicePathString = DevicePathToString(BootDiskPath);
-	PrintInfo(L"  %s", DevicePathString);
-	SafeFree(DevicePathString);
-	// Enumerate all disk handles
-	Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiDiskIoProtocolGuid,
-		NULL, &HandleCount, &Handles);
+	// Tune our reads to the transport of the boot disk
+	GetIoProfile(BootHandle, &IoProfile);
+	PrintDebug(L"Boot disk transport: %s (transfer size %d KB, alignment %d)",
+		GetTransportName(IoProfile.Transport), IoProfile.TransferSize / 1024, IoProfile.Alignment);
+
+#if FEATURE_DRIVER_PACK
+	// Have the extra storage drivers we may have been provided with take over the boot disk
+	Status = LoadDriverPack(&BootHandle, SecureBootStatus);
 	if (EFI_ERROR(Status)) {
-		PrintError(L"  Failed to list disks");
+		PrintError(L"  Could not reconnect boot disk");
 		goto out;
 	}
-
-	// Go through the partitions and find the one that has the USB Disk we booted from
-	// as parent and that isn't the FAT32 boot partition
-	for (Index = 0; Index < HandleCount; Index++) {
-		// Note: The Device Path obtained from DevicePathFromHandle() should NOT be freed!
-		DevicePath = DevicePathFromHandle(Handles[Index]);
-		// Eliminate the partition we booted from
-		if (CompareDevicePaths(DevicePath, BootPartitionPath) == 0)
-			continue;
-		// Ensure that we look for the NTFS/exFAT partition on the same device.
-		ParentDevicePath = GetParentDevice(DevicePath);
-		SameDevice = (CompareDevicePaths(BootDiskPath, ParentDevicePath) == 0);
-		SafeFree(ParentDevicePath);
-		// The check breaks QEMU testing (since we can't easily emulate
-		// a multipart device on the fly) so only do it for release.
-#if !defined(_DEBUG)
-		if (!SameDevice)
-			continue;
-#else
-		(VOID)SameDevice;	// Silence a MinGW warning
 #endif
-		// Read the first block of the partition and look for the FS magic in the OEM ID
-		Status = gBS->OpenProtocol(Handles[Index], &gEfiBlockIoProtocolGuid,
-			(VOID**)&BlockIo, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-		if (EFI_ERROR(Status))
-			continue;
-		Buffer = (CHAR8*)AllocatePool(BlockIo->Media->BlockSize);
-		if (Buffer == NULL)
-			continue;
-		Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, 0, BlockIo->Media->BlockSize, Buffer);
-		for (FsType = 0; (FsType < ARRAY_SIZE(FsName)) && 
-			(CompareMem(&Buffer[3], FsMagic[FsType], sizeof(FsMagic[FsType])) != 0); FsType++);
-		FreePool(Buffer);
-		if (EFI_ERROR(Status))
-			continue;
-		if (FsType < ARRAY_SIZE(FsName))
-			break;
+
+	// Identify our boot partition and disk
+	BootPartitionPath = DevicePathFromHandle(BootHandle);
+	BootDiskPath = GetParentDevice(BootPartitionPath);
+	InitDevicePathView(&BootPartition, BootPartitionPath);
+	InitDevicePathView(&BootDisk, BootDiskPath);
+
+	StartPhase(PHASE_DISCONNECT);
+	if (Profile.Flags & PROFILE_SKIP_DISCONNECT) {
+		PrintInfo(L"Skipping blocking drivers check (none found on previous boot)");
+	} else {
+		PrintInfo(L"Disconnecting potentially blocking drivers");
+		if (DisconnectBlockingDrivers(&BootDisk) == 0)
+			Profile.Flags |= PROFILE_SKIP_DISCONNECT;
 	}
+	EndPhase(PHASE_DISCONNECT);
 
-	if (Index >= HandleCount) {
+	PrintInfo(L"Searching for target partition on boot disk:");
+	PrintInfoPath(BootDiskPath, L"  %s");
+	StartPhase(PHASE_SCAN);
+	TargetHandle = FindTargetPartition(&BootPartition, &BootDisk, &FsType);
+	if (TargetHandle == NULL) {
+		// Firmwares with "Fast Boot" may not have produced the partition we are after
+		PrintWarning(L"  Target not found - connecting boot disk partitions");
+		if (ConnectBootDisk(&BootDisk) == EFI_SUCCESS)
+			TargetHandle = FindTargetPartition(&BootPartition, &BootDisk, &FsType);
+	}
+	// Some firmwares are still busy enumerating the boot disk at this stage
+	if (TargetHandle == NULL)
+		TargetHandle = WaitForTargetPartition(&BootPartition, &BootDisk, &FsType, DISCOVERY_TIMEOUT);
+	EndPhase(PHASE_SCAN);
+	if (TargetHandle == NULL) {
 		Status = EFI_NOT_FOUND;
 		PrintError(L"  Could not locate target partition");
 		goto out;
 	}
 	PrintInfo(L"Found %s target partition:", FsName[FsType]);
-	DevicePathString = DevicePathToString(DevicePath);
-	PrintInfo(L"  %s", DevicePathString);
-	SafeFree(DevicePathString);
+	PrintInfoPath(DevicePathFromHandle(TargetHandle), L"  %s");
+#if FEATURE_TELEMETRY
+	SetTelemetryTarget(FsName[FsType], NULL);
+#endif
 
 	// Test for presence of file system protocol (to see if there already is
 	// a filesystem driver servicing this partition)
-	Status = gBS->OpenProtocol(Handles[Index], &gEfiSimpleFileSystemProtocolGuid,
+	Status = gBS->OpenProtocol(TargetHandle, &gEfiSimpleFileSystemProtocolGuid,
 		(VOID**)&Volume, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_TEST_PROTOCOL);
 
 	// Only handle partitions that are flagged as serviced or needing service
@@ -374,36 +1268,19 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE BaseImageHandle, EFI_SYSTEM_TABLE *SystemT
 	// our target partition.
 	if (Status == EFI_SUCCESS) {
 		// Unload the driver and, if successful, flag the partition as needing service
-		if (UnloadDriver(Handles[Index]) == EFI_SUCCESS)
+		if (UnloadDriver(TargetHandle) == EFI_SUCCESS)
 			Status = EFI_UNSUPPORTED;
 	}
 
 	// If the partition is not/no-longer serviced, start our file system driver.
 	if (Status == EFI_UNSUPPORTED) {
 		PrintInfo(L"Starting %s driver service:", FsName[FsType]);
+		StartPhase(PHASE_DRIVER);
 
-		// Use 'rufus' in the driver path, so that we don't accidentally latch onto a user driver
-		UnicodeSPrint(DriverPath, ARRAY_SIZE(DriverPath), L"\\efi\\rufus\\%s_%s.efi", DriverName[FsType], Arch);
-		DevicePath = FileDevicePath(LoadedImage->DeviceHandle, DriverPath);
-		if (DevicePath == NULL) {
-			Status = EFI_DEVICE_ERROR;
-			PrintError(L"  Unable to set path for '%s'", DriverPath);
-			goto out;
-		}
-
-		// Attempt to load the driver.
-		// NB: If running in a Secure Boot enabled environment, LoadImage() will fail if
-		// the image being loaded does not pass the Secure Boot signature validation.
-		Status = gBS->LoadImage(FALSE, MainImageHandle, DevicePath, NULL, 0, &ImageHandle);
-		SafeFree(DevicePath);
-		if (EFI_ERROR(Status)) {
-			// Some platforms (e.g. Intel NUCs) return EFI_ACCESS_DENIED for Secure Boot
-			// validation errors. Return a much more explicit EFI_SECURITY_VIOLATION then.
-			if ((Status == EFI_ACCESS_DENIED) && (SecureBootStatus >= 1))
-				Status = EFI_SECURITY_VIOLATION;
-			PrintError(L"  Unable to load driver '%s'", DriverPath);
+		Status = LoadFileSystemDriver(DriverName[FsType], FsName[FsType], BootHandle,
+			SecureBootStatus, DriverPath, &ImageHandle);
+		if (EFI_ERROR(Status))
 			goto out;
-		}
 
 		// NB: Some HP firmwares refuse to start drivers that are not of type 'EFI Boot
 		// System Driver'. For instance, a driver of type 'EFI Runtime Driver' produces
@@ -426,37 +1303,59 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE BaseImageHandle, EFI_SYSTEM_TABLE *SystemT
 			PrintError(L"  Unable to start driver");
 			goto out;
 		}
-		PrintInfo(L"  %s", GetDriverName(ImageHandle));
+		EndPhase(PHASE_DRIVER);
+		PrintInfo(L"  %s (loaded in %d ms)", GetDriverName(ImageHandle), GetPhaseTime(PHASE_DRIVER));
+#if FEATURE_TELEMETRY
+		SetTelemetryTarget(FsName[FsType], GetDriverName(ImageHandle));
+#endif
+		ReportMemoryUsage(L"after driver start");
 
-		// Calling ConnectController() on a handle, with a NULL-terminated list of
-		// drivers will start all the drivers from the list that can service it
-		DriverHandleList[0] = ImageHandle;
-		DriverHandleList[1] = NULL;
-		Status = gBS->ConnectController(Handles[Index], DriverHandleList, NULL, TRUE);
+		Status = ConnectFileSystemDriver(TargetHandle, ImageHandle);
+		// The media or the firmware may have changed since we found no blocking
+		// drivers, so fall back to disconnecting them before we give up.
+		if (EFI_ERROR(Status) && (Profile.Flags & PROFILE_SKIP_DISCONNECT)) {
+			PrintWarning(L"  Could not start %s partition service - disconnecting blocking drivers", FsName[FsType]);
+			Profile.Flags &= ~PROFILE_SKIP_DISCONNECT;
+			Profile.FellBack = TRUE;
+			StartPhase(PHASE_DISCONNECT);
+			DisconnectBlockingDrivers(&BootDisk);
+			EndPhase(PHASE_DISCONNECT);
+			Status = ConnectFileSystemDriver(TargetHandle, ImageHandle);
+		}
 		if (EFI_ERROR(Status)) {
 			PrintError(L"  Could not start %s partition service", FsName[FsType]);
 			goto out;
 		}
+		ReportMemoryUsage(L"after driver connect");
 	}
 
 	// Our target file system is case sensitive, so we need to figure out the
 	// case sensitive version of the following
-	UnicodeSPrint(LoaderPath, ARRAY_SIZE(LoaderPath), L"\\efi\\boot\\boot%s.efi", Arch);
+	GetLoaderCandidates();
 
 	PrintInfo(L"Opening target %s partition:", FsName[FsType]);
-	// Open the the volume, with retry, as we may need to wait before poking
+	StartPhase(PHASE_OPEN);
+	// Open the the volume, polling for it, as we may need to wait before poking
 	// at the FS content, in case the system is slow to start our service...
-	for (Try = 0; ; Try++) {
-		Status = gBS->OpenProtocol(Handles[Index], &gEfiSimpleFileSystemProtocolGuid,
+	for (Waited = 0; ; Waited += RETRY_INTERVAL) {
+		Status = gBS->OpenProtocol(TargetHandle, &gEfiSimpleFileSystemProtocolGuid,
 			(VOID**)&Volume, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
 		if (!EFI_ERROR(Status))
 			break;
-		PrintError(L"  Could not open partition");
-		if (Try >= NUM_RETRIES)
+		if (Waited >= DELAY * 1000) {
+			PrintError(L"  Could not open partition");
 			goto out;
-		PrintWarning(L"  Waiting %d seconds before retrying...", DELAY);
-		gBS->Stall(DELAY * 1000000);
+		}
+		if (Waited == 0) {
+			PrintWarning(L"  Waiting up to %d ms for partition to become available...", DELAY * 1000);
+#if FEATURE_PREFLIGHT
+			ReadSecureBootDatabases();
+#endif
+		}
+		gBS->Stall(RETRY_INTERVAL * 1000);
 	}
+	if (Waited != 0)
+		PrintInfo(L"  Partition became available after %d ms", Waited);
 
 	// Open the root directory
 	Root = NULL;
@@ -466,86 +1365,64 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE BaseImageHandle, EFI_SYSTEM_TABLE *SystemT
 		goto out;
 	}
 
+#if FEATURE_VOLUME_LABEL
 	// Get the volume label while we're at it
-	Size = FILE_INFO_SIZE;
-	VolumeInfo = (EFI_FILE_SYSTEM_VOLUME_LABEL*)AllocateZeroPool(Size);
-	if (VolumeInfo != NULL) {
-		Status = Root->GetInfo(Root, &gEfiFileSystemVolumeLabelInfoIdGuid, &Size, VolumeInfo);
-		// Some UEFI firmwares return EFI_BUFFER_TOO_SMALL, even with
-		// a large enough buffer, unless the exact size is requested.
-		if ((Status == EFI_BUFFER_TOO_SMALL) && (Size <= FILE_INFO_SIZE))
-			Status = Root->GetInfo(Root, &gEfiFileSystemVolumeLabelInfoIdGuid, &Size, VolumeInfo);
-		if (Status == EFI_SUCCESS)
-			PrintInfo(L"  Volume label is '%s'", VolumeInfo->VolumeLabel);
-		else
-			PrintWarning(L"  Could not read volume label: [%d] %r\n", (Status & 0x7FFFFFFF), Status);
-		FreePool(VolumeInfo);
-	}
+	PrintVolumeLabel(Root);
+#endif
 
 	PrintInfo(L"This system uses %s UEFI => searching for %s EFI bootloader", ArchName, Arch);
-	// This next call corrects the casing to the required one
-	Status = SetPathCase(Root, LoaderPath);
+	// This next call picks the first loader that exists, and corrects its casing
+	Status = FindFirstPath(Root, LoaderPath, LoaderCount, &Index);
 	if (EFI_ERROR(Status)) {
-		PrintError(L"  Could not locate '%s'", &LoaderPath[1]);
+		PrintError(L"  Could not locate '%s'", &LoaderPath[0][1]);
 		goto out;
 	}
 
 	// At this stage, our DevicePath is the partition we are after
-	PrintInfo(L"Launching '%s'...", &LoaderPath[1]);
-
-	// Now attempt to chain load boot###.efi on the target partition
-	DevicePath = FileDevicePath(Handles[Index], LoaderPath);
-	if (DevicePath == NULL) {
-		Status = EFI_DEVICE_ERROR;
-		PrintError(L"  Could not create path");
-		goto out;
-	}
-	Status = gBS->LoadImage(FALSE, MainImageHandle, DevicePath, NULL, 0, &ImageHandle);
-	SafeFree(DevicePath);
-	if (EFI_ERROR(Status)) {
-		if ((Status == EFI_ACCESS_DENIED) && (SecureBootStatus >= 1))
-			Status = EFI_SECURITY_VIOLATION;
-		PrintError(L"  Load failure");
-		goto out;
-	}
-
-	// Look for a "bootmgr.dll" string in the loaded image to identify a Windows bootloader.
-	BootMgrName[0] = BootMgrNameFirstLetter;
-	Status = gBS->OpenProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid,
-		(VOID**)&LoadedImage, MainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-	if (EFI_ERROR(Status)) {
-		PrintWarning(L"  Unable to inspect loaded executable");
-	} else for (Index = 0x40; Index < LoadedImage->ImageSize - sizeof(BootMgrName); Index++) {
-		if (CompareMem((CHAR8*)((UINTN)LoadedImage->ImageBase + Index),
-			BootMgrName, sizeof(BootMgrName)) == 0) {
-			WindowsBootMgr = TRUE;
-			PrintInfo(L"Starting Microsoft Windows bootmgr...");
-			break;
-		}
-	}
+	EndPhase(PHASE_OPEN);
+#if FEATURE_METADATA_CACHE
+	ReportMetadataCache();
+#endif
 
-	Status = gBS->StartImage(ImageHandle, NULL, NULL);
-	if (EFI_ERROR(Status)) {
-		// Windows bootmgr simply returns EFI_NO_MAPPING on any internal error or security
-		// violation, instead of halting and explicitly reporting the issue, leaving many
-		// users extremely confused as to why their media did not boot. This can happen, for
-		// instance, if the machine has had the BlackLotus UEFI lock enabled and the user
-		// attempts to boot a pre 2023.05 version of the Windows installers.
-		// We therefore take it upon ourselves to report what Windows bootmgr will not report.
-		if (Status == EFI_NO_MAPPING && WindowsBootMgr) {
-			SetText(TEXT_RED); Print(L"[FAIL]"); DefText();
-			Print(L"   Windows bootmgr encountered a security validation or internal error\n");
-		} else
-			PrintError(L"  Start failure");
-	}
+	// Keep the driver, the volume and the bootloader images around, so
+	// that we can relaunch quickly if the bootloader returns.
+	do {
+		Status = StartLoader(TargetHandle, Root, Index, SecureBootStatus);
+	} while (PromptRelaunch(Root, &Index, Status));
+	Prompted = TRUE;
 
 out:
-	SafeFree(ParentDevicePath);
+#if FEATURE_READAHEAD
+	// Our BlockIo cache must be gone before we are
+	StopReadAhead();
+#endif
+#if FEATURE_TRACE
+	// The trace sits on top of the metadata cache, so it must go first
+	StopTrace();
+#endif
+#if FEATURE_METADATA_CACHE
+	StopMetadataCache();
+#endif
+#if FEATURE_READONLY
+	StopReadOnlyFilter();
+#endif
+	// Only record a failed boot if we never got to record the launch above
+	if (EFI_ERROR(Status) && !BootRecorded) {
+		SaveProfile(BootRoot, &Profile, FALSE);
+#if FEATURE_PREFLIGHT
+		SaveDigestCache(BootRoot);
+#endif
+		WriteBootLog();
+	}
+	if (BootRoot != NULL)
+		BootRoot->Close(BootRoot);
 	SafeFree(BootDiskPath);
-	SafeFree(Handles);
+	for (Index = 0; Index < LoaderCount; Index++)
+		SafeFree(LoaderImage[Index]);
+	FreePlatformState();
 
-	// Wait for a keystroke on error
-	if (EFI_ERROR(Status)) {
+	// Wait for a keystroke on error, unless the user already chose to exit
+	if (EFI_ERROR(Status) && !Prompted) {
 		SetText(TEXT_YELLOW);
 		Print(L"\nPress any key to exit.\n");
 		DefText();
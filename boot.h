@@ -63,18 +63,30 @@
 #define PATH_MAX            512
 #endif
 
+/* Maximum number of paths we may look up in one go */
+#define MAX_PATH_CANDIDATES 8
+
 /* Maximum size for the File Info structure we query */
 #define FILE_INFO_SIZE      (PATH_MAX * sizeof(CHAR16))
 
 /* For safety, we set a maximum size that strings shall not outgrow */
 #define STRING_MAX          (PATH_MAX + 2)
 
-/* Number of times we retry opening a volume */
-#define NUM_RETRIES         1
-
-/* Delay before retry, in seconds*/
+/* Maximum delay we wait for a volume to become available, in seconds */
 #define DELAY               3
 
+/* Maximum delay we wait for the target partition to appear, in milliseconds */
+#define DISCOVERY_TIMEOUT   (DELAY * 1000)
+
+/* Interval at which we poll for a volume we are waiting on, in milliseconds */
+#define RETRY_INTERVAL      100
+
+/* Delay after which we stop offering to relaunch a bootloader that returned, in seconds */
+#define RELAUNCH_TIMEOUT    10
+
+/* Mount time above which we warn that the volume is likely dirty, in milliseconds */
+#define MOUNT_WARN_TIME     2000
+
 /* Macro used to compute the size of an array */
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(Array)   (sizeof(Array) / sizeof((Array)[0]))
@@ -102,15 +114,118 @@
 #define SetText(attr)        gST->ConOut->SetAttribute(gST->ConOut, (attr))
 #define DefText()            gST->ConOut->SetAttribute(gST->ConOut, TEXT_DEFAULT)
 
+/*
+ * Log levels. Messages above LOG_MAX_LEVEL are compiled out altogether, along
+ * with the evaluation of their arguments. Messages above the runtime LogLevel
+ * are recorded, but not displayed.
+ */
+#define LOG_ERROR            0
+#define LOG_WARN             1
+#define LOG_INFO             2
+#define LOG_DEBUG            3
+#define LOG_TRACE            4
+
+#ifndef LOG_MAX_LEVEL
+#if defined(_DEBUG)
+#define LOG_MAX_LEVEL        LOG_TRACE
+#else
+#define LOG_MAX_LEVEL        LOG_DEBUG
+#endif
+#endif
+
+#ifndef LOG_DEFAULT_LEVEL
+#define LOG_DEFAULT_LEVEL    LOG_INFO
+#endif
+
+extern UINTN LogLevel;
+
+/*
+ * Optional features, which can be compiled out individually with -DFEATURE_<NAME>=0.
+ * Defining LITE disables all of them by default, which only leaves what is needed
+ * to find the target partition, start its driver, resolve paths and chain load.
+ */
+#if defined(LITE)
+#define FEATURE_DEFAULT      0
+#else
+#define FEATURE_DEFAULT      1
+#endif
+
+#ifndef FEATURE_BANNER
+#define FEATURE_BANNER       FEATURE_DEFAULT	/* Application banner */
+#endif
+#ifndef FEATURE_SYSTEM_INFO
+#define FEATURE_SYSTEM_INFO  FEATURE_DEFAULT	/* Firmware, SMBIOS and Secure Boot status report */
+#endif
+#ifndef FEATURE_VOLUME_LABEL
+#define FEATURE_VOLUME_LABEL FEATURE_DEFAULT	/* Target volume label query */
+#endif
+#ifndef FEATURE_PATH_HEX
+#define FEATURE_PATH_HEX     FEATURE_DEFAULT	/* Device paths as hex, without DevicePathToText */
+#endif
+#ifndef FEATURE_PROFILES
+#define FEATURE_PROFILES     FEATURE_DEFAULT	/* Per-platform boot profiles */
+#endif
+#ifndef FEATURE_PREFLIGHT
+#define FEATURE_PREFLIGHT    FEATURE_DEFAULT	/* Secure Boot preflight and digest cache */
+#endif
+#ifndef FEATURE_READAHEAD
+#define FEATURE_READAHEAD    FEATURE_DEFAULT	/* Windows boot files read-ahead */
+#endif
+#ifndef FEATURE_METADATA_CACHE
+#define FEATURE_METADATA_CACHE FEATURE_DEFAULT	/* File system metadata cache */
+#endif
+#ifndef FEATURE_DRIVER_PACK
+#define FEATURE_DRIVER_PACK  FEATURE_DEFAULT	/* Extra storage drivers */
+#endif
+#ifndef FEATURE_LOG_FILE
+#define FEATURE_LOG_FILE     FEATURE_DEFAULT	/* In-memory log, saved to the boot volume */
+#endif
+#ifndef FEATURE_TELEMETRY
+#define FEATURE_TELEMETRY    FEATURE_DEFAULT	/* Boot metrics, published for the OS */
+#endif
+/* Not a default feature, as it costs memory and is only meant for cache sizing */
+#ifndef FEATURE_TRACE
+#define FEATURE_TRACE        0	/* Trace of the disk requests from the file system driver */
+#endif
+/* Not a default feature, as it changes what the driver can do with the target */
+#ifndef FEATURE_READONLY
+#if defined(FORCE_READONLY)
+#define FEATURE_READONLY     1	/* Present the target partition as read-only */
+#else
+#define FEATURE_READONLY     0
+#endif
+#endif
+
 /*
  * Convenience macros to print informational, warning or error messages.
  */
-#define PrintInfo(fmt, ...)  do { SetText(TEXT_WHITE); Print(L"[INFO]"); DefText(); \
-                                     Print(L" " fmt L"\n", ##__VA_ARGS__); } while(0)
-#define PrintWarning(fmt, ...)  do { SetText(TEXT_YELLOW); Print(L"[WARN]"); DefText(); \
-                                     Print(L" " fmt L"\n", ##__VA_ARGS__); } while(0)
-#define PrintError(fmt, ...)    do { SetText(TEXT_RED); Print(L"[FAIL]"); DefText(); \
-                                     Print(L" " fmt L": [%d] %r\n", ##__VA_ARGS__, (Status&0x7FFFFFFF), Status); } while (0)
+#define PrintLog(l, fmt, ...)   do { if ((l) <= LOG_MAX_LEVEL) LogPrint(l, fmt, ##__VA_ARGS__); } while(0)
+#define PrintTrace(fmt, ...)    PrintLog(LOG_TRACE, fmt, ##__VA_ARGS__)
+#define PrintDebug(fmt, ...)    PrintLog(LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define PrintInfo(fmt, ...)     PrintLog(LOG_INFO, fmt, ##__VA_ARGS__)
+#define PrintWarning(fmt, ...)  PrintLog(LOG_WARN, fmt, ##__VA_ARGS__)
+#define PrintError(fmt, ...)    PrintLog(LOG_ERROR, fmt L": [%d] %r", ##__VA_ARGS__, (Status&0x7FFFFFFF), Status)
+
+/*
+ * Whether a message of level l goes anywhere, i.e. whether it is compiled in
+ * and either recorded in the log or visible at the current runtime level.
+ */
+#define IsLogEmitted(l)         (((l) <= LOG_MAX_LEVEL) && (FEATURE_LOG_FILE || ((l) <= LogLevel)))
+
+/*
+ * Same as above, for messages that include the text of a device path, which
+ * is passed as the last argument for the format string. The device path only
+ * gets converted to text when the message is emitted.
+ */
+#define PrintLogPath(l, dp, fmt, ...)  do { if (IsLogEmitted(l)) { CHAR16* _PathString = DevicePathToString(dp); \
+                                     LogPrint(l, fmt, ##__VA_ARGS__, _PathString); \
+                                     if (_PathString != NULL) FreePool(_PathString); } } while(0)
+#define PrintDebugPath(dp, fmt, ...)   PrintLogPath(LOG_DEBUG, dp, fmt, ##__VA_ARGS__)
+#define PrintInfoPath(dp, fmt, ...)    PrintLogPath(LOG_INFO, dp, fmt, ##__VA_ARGS__)
+#define PrintWarningPath(dp, fmt, ...) PrintLogPath(LOG_WARN, dp, fmt, ##__VA_ARGS__)
+#define PrintErrorPath(dp, fmt, ...)   do { CHAR16* _PathString = DevicePathToString(dp); \
+                                     LogPrint(LOG_ERROR, fmt L": [%d] %r", ##__VA_ARGS__, _PathString, (Status&0x7FFFFFFF), Status); \
+                                     if (_PathString != NULL) FreePool(_PathString); } while(0)
 
 /* Convenience assertion macro */
 #define P_ASSERT(f, l, a)   if(!(a)) do { Print(L"*** ASSERT FAILED: %a(%d): %a ***\n", f, l, #a); while(1); } while(0)
@@ -127,6 +242,24 @@
 #define COMPARE_GUID CompareGuid
 #endif
 
+/*
+ * Same for DivU64x32(), where gnu-efi adds a Remainder parameter.
+ */
+#if defined(_GNU_EFI)
+#define DIV_U64(a, b)       DivU64x32(a, b, NULL)
+#else
+#define DIV_U64(a, b)       DivU64x32(a, b)
+#endif
+
+/*
+ * Older gnu-efi releases only provide the lowercase variable argument macros.
+ */
+#if defined(_GNU_EFI) && !defined(VA_START)
+#define VA_LIST             va_list
+#define VA_START            va_start
+#define VA_END              va_end
+#endif
+
 /*
  * Secure string length, that asserts if the string is NULL or if
  * the length is larger than a predetermined value (STRING_MAX)
@@ -188,12 +321,251 @@ static __inline VOID _SafeStrCpy(CHAR16* Destination, UINTN DestMax,
 
 #define SafeStrCpy(d, l, s) _SafeStrCpy(d, l, s, __FILE__, __LINE__)
 
+/*
+ * 64-bit FNV-1a hash, for data we only need to identify rather than secure.
+ */
+#define FNV1A64_INIT        0xcbf29ce484222325ULL
+
+static __inline UINT64 Fnv1a64(UINT64 Hash, CONST VOID* Data, UINTN Size)
+{
+	CONST UINT8* p = (CONST UINT8*)Data;
+
+	while (Size-- > 0) {
+		Hash ^= *p++;
+		Hash *= 0x100000001b3ULL;
+	}
+	return Hash;
+}
+
+/*
+ * Length of an ASCII string, as gnu-efi does not provide AsciiStrLen().
+ */
+static __inline UINTN _AsciiStrLen(CONST CHAR8* String)
+{
+	UINTN Len;
+
+	for (Len = 0; (Len < STRING_MAX) && (String[Len] != 0); Len++);
+	return Len;
+}
+
+/*
+ * Look for a sequence of bytes in a buffer.
+ */
+static __inline BOOLEAN FindMem(CONST VOID* Buffer, CONST UINTN Size, CONST VOID* Data, CONST UINTN DataSize)
+{
+	UINTN i;
+
+	for (i = 0; i + DataSize <= Size; i++) {
+		if (CompareMem((CONST UINT8*)Buffer + i, Data, DataSize) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * SHA-256 digests, for image verification
+ */
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct {
+	UINT32  State[8];
+	UINT64  Length;
+	UINT8   Buffer[64];
+} SHA256_CONTEXT;
+
+/*
+ * What tells apart two versions of a file, for the purpose of caching its digest.
+ * UEFI does not expose NTFS MFT references or FAT clusters, so we use the sizes
+ * and time stamps of the file, along with a hash of its path.
+ */
+#pragma pack(push, 1)
+typedef struct {
+	UINT64  PathHash;
+	UINT64  FileSize;
+	UINT64  PhysicalSize;
+	EFI_TIME CreateTime;
+	EFI_TIME ModificationTime;
+} FILE_IDENTITY;
+#pragma pack(pop)
+
+/*
+ * A read-only view of a device path, with precomputed sizes for comparison
+ */
+typedef struct {
+	CONST EFI_DEVICE_PATH* DevicePath;
+	UINTN   Size;			/* Size of the path, without the end node */
+	UINTN   ParentSize;		/* Size of the path, without the last node */
+} DEVICE_PATH_VIEW;
+
+/*
+ * Boot phases for which we record timings
+ */
+typedef enum {
+	PHASE_DISCONNECT = 0,
+	PHASE_SCAN,
+	PHASE_DRIVER,
+	PHASE_CONNECT,
+	PHASE_OPEN,
+	PHASE_LOADER,
+	PHASE_MAX
+} BOOT_PHASE;
+
+/*
+ * Per-platform settings, learned from previous boots of the same hardware
+ */
+#define PROFILE_SKIP_DISCONNECT 0x00000001	/* No blocking drivers were found */
+
+typedef struct {
+	UINT64  Key;
+	UINT32  Flags;
+	UINT16  Boots;			/* Number of successful boots on record */
+	BOOLEAN FellBack;		/* The learned settings had to be reverted during this boot */
+} BOOT_PROFILE;
+
+/*
+ * Disk transports, from the slowest to the fastest, for I/O tuning
+ */
+typedef enum {
+	TRANSPORT_UNKNOWN = 0,
+	TRANSPORT_USB1,
+	TRANSPORT_USB2,
+	TRANSPORT_USB3,
+	TRANSPORT_UAS,
+	TRANSPORT_ATA,
+	TRANSPORT_SATA,
+	TRANSPORT_SCSI,
+	TRANSPORT_NVME,
+	TRANSPORT_UFS,
+	TRANSPORT_SD,
+	TRANSPORT_EMMC,
+	TRANSPORT_MAX
+} TRANSPORT_TYPE;
+
+#define IS_USB_TRANSPORT(t) (((t) >= TRANSPORT_USB1) && ((t) <= TRANSPORT_UAS))
+
+/* Largest read we ever issue in one go, in bytes */
+#define MAX_TRANSFER_SIZE   (1024 * 1024)
+
+/*
+ * How reads should be issued to a disk, for best performance
+ */
+typedef struct {
+	TRANSPORT_TYPE Transport;
+	UINT32  TransferSize;		/* Preferred read size, in bytes */
+	UINT32  Alignment;		/* Buffer alignment, in bytes */
+	EFI_LBA LowestAlignedLba;	/* First LBA aligned to a physical block */
+	UINT16  UsbMaxPacketSize;	/* For USB devices, the size of bulk packets */
+} IO_PROFILE;
+
+/*
+ * Snapshot of the platform variables we use, which are read only once
+ */
+typedef struct {
+	BOOLEAN HasSecureBoot;		/* The SecureBoot variable exists */
+	UINT8   SecureBoot;
+	UINT8   SetupMode;
+	UINT8   AuditMode;
+	UINT8   DeployedMode;
+	UINT16  BootCurrent;		/* 0xFFFF if unknown */
+	UINT16  BootOrderFirst;		/* 0xFFFF if unknown */
+	UINTN   BootOrderCount;
+	BOOLEAN HasDatabases;		/* The entries below were read (FEATURE_PREFLIGHT) */
+	UINT8*  Db;
+	UINTN   DbSize;
+	UINT8*  Dbx;
+	UINTN   DbxSize;
+	CHAR8*  SbatLevel;
+	UINTN   SbatLevelSize;
+} PLATFORM_STATE;
+
+/*
+ * What we can tell about an executable from its headers
+ */
+#define PE_SUBSYSTEM_APPLICATION        10
+#define PE_SUBSYSTEM_BOOT_DRIVER        11
+#define PE_SUBSYSTEM_RUNTIME_DRIVER     12
+
+typedef struct {
+	UINT16  Machine;
+	UINT16  Subsystem;
+	UINT32  SecurityOffset;
+	UINT32  SecuritySize;		/* Non zero if the executable is signed */
+	BOOLEAN NativeMachine;		/* The executable is for our architecture */
+	BOOLEAN TrustedIssuer;		/* Signed with a widely trusted certificate */
+} PE_INFO;
+
 /*
  * Function prototypes
  */
 EFI_DEVICE_PATH* GetParentDevice(CONST EFI_DEVICE_PATH* DevicePath);
 INTN CompareDevicePaths(CONST EFI_DEVICE_PATH* dp1, CONST EFI_DEVICE_PATH* dp2);
+VOID InitDevicePathView(DEVICE_PATH_VIEW* View, CONST EFI_DEVICE_PATH* DevicePath);
+BOOLEAN IsSameDevicePath(CONST DEVICE_PATH_VIEW* View1, CONST DEVICE_PATH_VIEW* View2);
+BOOLEAN IsParentDevicePath(CONST DEVICE_PATH_VIEW* Parent, CONST DEVICE_PATH_VIEW* Child);
 EFI_STATUS SetPathCase(CONST EFI_FILE_HANDLE Root, CHAR16* Path);
+EFI_STATUS FindFirstPath(CONST EFI_FILE_HANDLE Root, CHAR16** Candidates, CONST UINTN Count, UINTN* Index);
+EFI_STATUS OpenRoot(CONST EFI_HANDLE DeviceHandle, EFI_FILE_HANDLE* Root);
+EFI_STATUS ReadFileData(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, VOID* Buffer, UINTN* Size);
+EFI_STATUS ReadWholeFile(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, VOID** Buffer, UINTN* Size,
+	FILE_IDENTITY* Identity);
+EFI_STATUS WriteFileData(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, CONST VOID* Buffer, UINTN Size);
+EFI_STATUS DevicePathToHex(CONST EFI_DEVICE_PATH* DevicePath, CHAR16* Buffer, UINTN* Size);
 CHAR16* DevicePathToString(CONST EFI_DEVICE_PATH* DevicePath);
 EFI_STATUS PrintSystemInfo(VOID);
 INTN GetSecureBootStatus(VOID);
+CONST PLATFORM_STATE* GetPlatformState(VOID);
+VOID PrintPlatformState(VOID);
+VOID ReadSecureBootDatabases(VOID);
+VOID FreePlatformState(VOID);
+UINT64 GetPlatformKey(VOID);
+VOID InitTimer(VOID);
+BOOLEAN IsTimerPrecise(VOID);
+UINT64 GetElapsedTime(VOID);
+UINT64 GetElapsedTimeUs(VOID);
+VOID StartPhase(CONST BOOT_PHASE Phase);
+VOID EndPhase(CONST BOOT_PHASE Phase);
+UINT32 GetPhaseTime(CONST BOOT_PHASE Phase);
+VOID ReportMemoryUsage(CONST CHAR16* Label);
+UINT64 GetFreeMemory(UINT64* LargestFree);
+EFI_STATUS LoadProfile(CONST EFI_FILE_HANDLE Root, CONST EFI_DEVICE_PATH* BootPath, BOOT_PROFILE* Profile);
+EFI_STATUS SaveProfile(CONST EFI_FILE_HANDLE Root, CONST BOOT_PROFILE* Profile, CONST BOOLEAN Success);
+VOID LogPrint(CONST UINTN Level, CONST CHAR16* Format, ...);
+VOID SetLogLevel(CONST CHAR16* Options, CONST UINTN Size);
+UINTN GetLog(CONST CHAR8** Part1, UINTN* Size1, CONST CHAR8** Part2, UINTN* Size2);
+EFI_STATUS SaveLog(CONST EFI_FILE_HANDLE Root);
+VOID Sha256Init(SHA256_CONTEXT* Context);
+VOID Sha256Update(SHA256_CONTEXT* Context, CONST VOID* Data, UINTN Size);
+VOID Sha256Final(SHA256_CONTEXT* Context, UINT8* Digest);
+EFI_STATUS GetPeInfo(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, PE_INFO* Info);
+EFI_STATUS GetPeSignature(CONST UINT8* Image, CONST UINTN Size, CONST UINT8** Signature, UINTN* SignatureSize);
+EFI_STATUS GetPeSection(CONST UINT8* Image, CONST UINTN Size, CONST CHAR8* Name, CONST UINT8** Data, UINTN* DataSize);
+EFI_STATUS GetAuthenticodeHash(CONST UINT8* Image, CONST UINTN Size, UINT8* Digest);
+EFI_STATUS CheckRevocation(CONST UINT8* Image, CONST UINTN Size, CONST FILE_IDENTITY* Identity);
+EFI_STATUS LoadDigestCache(CONST EFI_FILE_HANDLE Root);
+BOOLEAN LookupDigest(CONST FILE_IDENTITY* Identity, UINT8* Digest);
+VOID StoreDigest(CONST FILE_IDENTITY* Identity, CONST UINT8* Digest);
+EFI_STATUS SaveDigestCache(CONST EFI_FILE_HANDLE Root);
+EFI_STATUS GetIoProfile(CONST EFI_HANDLE Handle, IO_PROFILE* IoProfile);
+CONST CHAR16* GetTransportName(CONST TRANSPORT_TYPE Transport);
+VOID* AllocateIoBuffer(CONST UINTN Size, CONST UINT32 Alignment);
+VOID FreeIoBuffer(VOID* Buffer, CONST UINTN Size, CONST UINT32 Alignment);
+UINT32 MeasureThroughput(CONST EFI_HANDLE Handle, CONST IO_PROFILE* IoProfile);
+EFI_STATUS StartReadAhead(CONST EFI_HANDLE TargetHandle, CONST EFI_FILE_HANDLE Root, CONST IO_PROFILE* IoProfile);
+UINT64 GetReadAheadStats(UINT32* Extents);
+VOID StopReadAhead(VOID);
+EFI_STATUS StartMetadataCache(CONST EFI_HANDLE TargetHandle);
+VOID ReportMetadataCache(VOID);
+VOID GetMetadataCacheStats(UINT32* HitCount, UINT32* MissCount, UINT32* BypassCount);
+VOID StopMetadataCache(VOID);
+EFI_STATUS StartReadOnlyFilter(CONST EFI_HANDLE TargetHandle);
+VOID ReportReadOnlyFilter(VOID);
+VOID LockReadOnlyFilter(VOID);
+VOID GetReadOnlyFilterStats(UINT32* WriteCount, UINT32* RejectedCount);
+VOID StopReadOnlyFilter(VOID);
+EFI_STATUS StartTrace(CONST EFI_HANDLE TargetHandle);
+EFI_STATUS SaveTrace(CONST EFI_FILE_HANDLE Root);
+VOID StopTrace(VOID);
+BOOLEAN GetEmbeddedDriver(CONST CHAR16* Name, CONST VOID** Buffer, UINTN* Size);
+VOID SetTelemetryTarget(CONST CHAR16* FileSystem, CONST CHAR16* Driver);
+EFI_STATUS PublishTelemetry(CONST CHAR16* Loader, CONST INTN SecureBootStatus, CONST UINT32 ProfileFlags,
+	CONST IO_PROFILE* IoProfile);
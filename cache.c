@@ -0,0 +1,136 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Verified image digest cache
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_PREFLIGHT
+/*
+ * Hashing a multi megabyte bootloader, from a slow USB stick, is something
+ * we'd rather not do on every boot. So we keep the digests we computed, along
+ * with the identity of the file they were computed from, in a small fixed
+ * size table on the FAT partition, and only hash files whose size or time
+ * stamps changed since. The digests are only ever used for our diagnostics,
+ * as the firmware still performs its own validation when the image is loaded.
+ */
+#define DIGEST_CACHE_PATH       L"\\efi\\rufus\\uefi-ntfs.sum"
+#define DIGEST_CACHE_MAGIC      0x4D555344	/* "DSUM" */
+#define DIGEST_CACHE_VERSION    1
+#define DIGEST_CACHE_ENTRIES    16
+
+#pragma pack(push, 1)
+typedef struct {
+	FILE_IDENTITY Identity;
+	UINT8   Digest[SHA256_DIGEST_SIZE];
+} DIGEST_ENTRY;
+
+typedef struct {
+	UINT32  Magic;
+	UINT16  Version;
+	UINT16  Count;
+	UINT64  Checksum;
+	DIGEST_ENTRY Entry[DIGEST_CACHE_ENTRIES];
+} DIGEST_TABLE;
+#pragma pack(pop)
+
+/* Entries are kept in the order they were added, most recent first */
+static DIGEST_TABLE Table;
+static BOOLEAN Dirty = FALSE;
+
+static UINT64 GetChecksum(VOID)
+{
+	return Fnv1a64(FNV1A64_INIT, Table.Entry, Table.Count * sizeof(DIGEST_ENTRY));
+}
+
+/*
+ * Read the digest cache from the FAT partition. On error, the cache is
+ * reset to empty, and all files will be hashed.
+ */
+EFI_STATUS LoadDigestCache(CONST EFI_FILE_HANDLE Root)
+{
+	EFI_STATUS Status;
+	UINTN Size = sizeof(Table);
+
+	Status = ReadFileData(Root, DIGEST_CACHE_PATH, &Table, &Size);
+	if (EFI_ERROR(Status) || (Size != sizeof(Table)) || (Table.Magic != DIGEST_CACHE_MAGIC) ||
+		(Table.Version != DIGEST_CACHE_VERSION) || (Table.Count > DIGEST_CACHE_ENTRIES) ||
+		(Table.Checksum != GetChecksum())) {
+		ZeroMem(&Table, sizeof(Table));
+		Table.Magic = DIGEST_CACHE_MAGIC;
+		Table.Version = DIGEST_CACHE_VERSION;
+		return EFI_ERROR(Status) ? Status : EFI_VOLUME_CORRUPTED;
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Look for the digest of a file. This only succeeds if every part of the
+ * identity of the file is the same as when the digest was computed.
+ */
+BOOLEAN LookupDigest(CONST FILE_IDENTITY* Identity, UINT8* Digest)
+{
+	UINTN Index;
+
+	for (Index = 0; Index < Table.Count; Index++) {
+		if (CompareMem(&Table.Entry[Index].Identity, Identity, sizeof(FILE_IDENTITY)) == 0) {
+			CopyMem(Digest, Table.Entry[Index].Digest, SHA256_DIGEST_SIZE);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Record the digest of a file, replacing any digest we had for the same path.
+ * Nothing is written until SaveDigestCache() is called.
+ */
+VOID StoreDigest(CONST FILE_IDENTITY* Identity, CONST UINT8* Digest)
+{
+	UINTN Index;
+
+	// Reuse the entry for an older version of the file, or evict the oldest entry
+	for (Index = 0; (Index < Table.Count) && (Table.Entry[Index].Identity.PathHash != Identity->PathHash); Index++);
+	if (Index >= Table.Count) {
+		if (Table.Count < DIGEST_CACHE_ENTRIES)
+			Table.Count++;
+		Index = Table.Count - 1;
+	}
+	for (; Index > 0; Index--)
+		CopyMem(&Table.Entry[Index], &Table.Entry[Index - 1], sizeof(DIGEST_ENTRY));
+
+	CopyMem(&Table.Entry[0].Identity, Identity, sizeof(FILE_IDENTITY));
+	CopyMem(Table.Entry[0].Digest, Digest, SHA256_DIGEST_SIZE);
+	Dirty = TRUE;
+}
+
+/* Write the digest cache back, if it changed */
+EFI_STATUS SaveDigestCache(CONST EFI_FILE_HANDLE Root)
+{
+	EFI_STATUS Status;
+
+	if (Root == NULL)
+		return EFI_INVALID_PARAMETER;
+	if (!Dirty)
+		return EFI_SUCCESS;
+
+	Table.Checksum = GetChecksum();
+	Status = WriteFileData(Root, DIGEST_CACHE_PATH, &Table, sizeof(Table));
+	if (!EFI_ERROR(Status))
+		Dirty = FALSE;
+	return Status;
+}
+#endif
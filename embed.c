@@ -0,0 +1,49 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Embedded file system driver
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if defined(EMBEDDED_DRIVER)
+/*
+ * A file system driver can be built into our binary, so that it doesn't have
+ * to be read from the boot partition. embedded_driver.h is generated from the
+ * driver with tools/embed.sh. Where the linker produces PE images directly, the
+ * driver gets a section of its own. ELF toolchains, that convert to PE with a
+ * fixed set of sections, keep it with the rest of our read-only data.
+ */
+#if defined(_MSC_VER)
+#pragma section(".fsdrv", read)
+#define EMBEDDED_DRIVER_SECTION __declspec(allocate(".fsdrv"))
+#elif defined(__MINGW32__)
+#define EMBEDDED_DRIVER_SECTION __attribute__((section(".fsdrv")))
+#else
+#define EMBEDDED_DRIVER_SECTION
+#endif
+
+#include "embedded_driver.h"
+
+/* Return the embedded driver, if it is the one for the file system we are after */
+BOOLEAN GetEmbeddedDriver(CONST CHAR16* Name, CONST VOID** Buffer, UINTN* Size)
+{
+	if (StrCmp(Name, EMBEDDED_DRIVER_NAME) != 0)
+		return FALSE;
+	*Buffer = EmbeddedDriver;
+	*Size = sizeof(EmbeddedDriver);
+	return TRUE;
+}
+#endif
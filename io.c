@@ -0,0 +1,360 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Transport aware I/O tuning
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/*
+ * Messaging device path subtypes we are interested in. Not all of these
+ * are defined by the environments we build with, so we use our own.
+ */
+#define MSG_NODE_ATAPI      0x01
+#define MSG_NODE_SCSI       0x02
+#define MSG_NODE_USB        0x05
+#define MSG_NODE_USB_CLASS  0x0F
+#define MSG_NODE_SATA       0x12
+#define MSG_NODE_NVME       0x17
+#define MSG_NODE_UFS        0x19
+#define MSG_NODE_SD         0x1A
+#define MSG_NODE_EMMC       0x1D
+
+#ifndef EFI_BLOCK_IO_PROTOCOL_REVISION3
+#define EFI_BLOCK_IO_PROTOCOL_REVISION3 ((2 << 16) | 31)
+#endif
+
+/*
+ * Minimal definition of EFI_USB_IO_PROTOCOL, which is not provided by all
+ * the environments we build with. We only ever query descriptors.
+ */
+#pragma pack(push, 1)
+typedef struct {
+	UINT8   Length;
+	UINT8   DescriptorType;
+	UINT16  BcdUSB;
+	UINT8   DeviceClass;
+	UINT8   DeviceSubClass;
+	UINT8   DeviceProtocol;
+	UINT8   MaxPacketSize0;
+	UINT16  IdVendor;
+	UINT16  IdProduct;
+	UINT16  BcdDevice;
+	UINT8   StrManufacturer;
+	UINT8   StrProduct;
+	UINT8   StrSerialNumber;
+	UINT8   NumConfigurations;
+} USB_DEVICE_DESCRIPTOR;
+
+typedef struct {
+	UINT8   Length;
+	UINT8   DescriptorType;
+	UINT8   InterfaceNumber;
+	UINT8   AlternateSetting;
+	UINT8   NumEndpoints;
+	UINT8   InterfaceClass;
+	UINT8   InterfaceSubClass;
+	UINT8   InterfaceProtocol;
+	UINT8   Interface;
+} USB_INTERFACE_DESCRIPTOR;
+
+typedef struct {
+	UINT8   Length;
+	UINT8   DescriptorType;
+	UINT8   EndpointAddress;
+	UINT8   Attributes;
+	UINT16  MaxPacketSize;
+	UINT8   Interval;
+} USB_ENDPOINT_DESCRIPTOR;
+#pragma pack(pop)
+
+typedef struct _USB_IO_PROTOCOL USB_IO_PROTOCOL;
+
+struct _USB_IO_PROTOCOL {
+	VOID*   UsbControlTransfer;
+	VOID*   UsbBulkTransfer;
+	VOID*   UsbAsyncInterruptTransfer;
+	VOID*   UsbSyncInterruptTransfer;
+	VOID*   UsbIsochronousTransfer;
+	VOID*   UsbAsyncIsochronousTransfer;
+	EFI_STATUS (EFIAPI *UsbGetDeviceDescriptor)(USB_IO_PROTOCOL* This, USB_DEVICE_DESCRIPTOR* Descriptor);
+	VOID*   UsbGetConfigDescriptor;
+	EFI_STATUS (EFIAPI *UsbGetInterfaceDescriptor)(USB_IO_PROTOCOL* This, USB_INTERFACE_DESCRIPTOR* Descriptor);
+	EFI_STATUS (EFIAPI *UsbGetEndpointDescriptor)(USB_IO_PROTOCOL* This, UINT8 EndpointIndex,
+		USB_ENDPOINT_DESCRIPTOR* Descriptor);
+};
+
+static EFI_GUID UsbIoProtocolGuid =
+	{ 0x2b2f68d6, 0x0cd2, 0x44cf, { 0x8e, 0x8b, 0xbb, 0xa2, 0x0b, 0x1b, 0x5b, 0x75 } };
+
+/* USB mass storage interface protocols */
+#define USB_MASS_STORAGE_CLASS  0x08
+#define USB_MASS_STORAGE_UAS    0x62
+
+/* USB endpoint attributes */
+#define USB_ENDPOINT_BULK       0x02
+#define USB_ENDPOINT_TYPE_MASK  0x03
+
+/*
+ * Default I/O settings for each transport. These are conservative values
+ * that match what the firmware drivers for each transport typically
+ * handle best, rather than what the hardware is capable of.
+ */
+static CONST struct {
+	CONST CHAR16* Name;
+	UINT32  TransferSize;
+} TransportDefaults[TRANSPORT_MAX] = {
+	{ L"Unknown",    64 * 1024 },
+	{ L"USB 1.1",    16 * 1024 },
+	{ L"USB 2.0",    64 * 1024 },
+	{ L"USB 3.x",   128 * 1024 },
+	{ L"UAS",       256 * 1024 },
+	{ L"ATA",       128 * 1024 },
+	{ L"SATA",      128 * 1024 },
+	{ L"SCSI",      128 * 1024 },
+	{ L"NVMe",      256 * 1024 },
+	{ L"UFS",       128 * 1024 },
+	{ L"SD",         64 * 1024 },
+	{ L"eMMC",       64 * 1024 },
+};
+
+/* Figure out the speed and protocol of a USB mass storage device */
+static TRANSPORT_TYPE GetUsbTransport(CONST EFI_DEVICE_PATH* DevicePath, UINT16* MaxPacketSize)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH* RemainingDevicePath = (EFI_DEVICE_PATH*)DevicePath;
+	EFI_HANDLE UsbHandle;
+	USB_IO_PROTOCOL* UsbIo;
+	USB_INTERFACE_DESCRIPTOR Interface;
+	USB_ENDPOINT_DESCRIPTOR Endpoint;
+	UINT8 Index;
+
+	*MaxPacketSize = 0;
+	Status = gBS->LocateDevicePath(&UsbIoProtocolGuid, &RemainingDevicePath, &UsbHandle);
+	if (EFI_ERROR(Status))
+		return TRANSPORT_USB2;
+	Status = gBS->HandleProtocol(UsbHandle, &UsbIoProtocolGuid, (VOID**)&UsbIo);
+	if (EFI_ERROR(Status) || (UsbIo->UsbGetInterfaceDescriptor(UsbIo, &Interface) != EFI_SUCCESS))
+		return TRANSPORT_USB2;
+
+	// The bulk endpoints' maximum packet size tells us the bus speed
+	for (Index = 0; Index < Interface.NumEndpoints; Index++) {
+		if ((UsbIo->UsbGetEndpointDescriptor(UsbIo, Index, &Endpoint) == EFI_SUCCESS) &&
+			((Endpoint.Attributes & USB_ENDPOINT_TYPE_MASK) == USB_ENDPOINT_BULK) &&
+			(Endpoint.MaxPacketSize > *MaxPacketSize))
+			*MaxPacketSize = Endpoint.MaxPacketSize;
+	}
+
+	if ((Interface.InterfaceClass == USB_MASS_STORAGE_CLASS) &&
+		(Interface.InterfaceProtocol == USB_MASS_STORAGE_UAS))
+		return TRANSPORT_UAS;
+	if (*MaxPacketSize >= 1024)
+		return TRANSPORT_USB3;
+	if ((*MaxPacketSize != 0) && (*MaxPacketSize < 512))
+		return TRANSPORT_USB1;
+	return TRANSPORT_USB2;
+}
+
+/*
+ * Build the I/O profile of the disk a BlockIo handle resides on, from the
+ * nodes of its device path, the USB descriptors if any, and the hints that
+ * revision 3 of the BlockIo protocol provides.
+ */
+EFI_STATUS GetIoProfile(CONST EFI_HANDLE Handle, IO_PROFILE* IoProfile)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH* DevicePath;
+	EFI_DEVICE_PATH* Node;
+	EFI_BLOCK_IO_PROTOCOL* BlockIo;
+	UINT32 Granularity;
+
+	V_ASSERT(IoProfile != NULL);
+	ZeroMem(IoProfile, sizeof(IO_PROFILE));
+	IoProfile->Transport = TRANSPORT_UNKNOWN;
+
+	DevicePath = DevicePathFromHandle(Handle);
+	if (DevicePath == NULL)
+		return EFI_NOT_FOUND;
+
+	// The node closest to the media wins, e.g. SCSI over USB is UAS or USB
+	for (Node = DevicePath; !IsDevicePathEnd(Node); Node = NextDevicePathNode(Node)) {
+		if (DevicePathType(Node) != MESSAGING_DEVICE_PATH)
+			continue;
+		switch (DevicePathSubType(Node)) {
+		case MSG_NODE_USB:
+		case MSG_NODE_USB_CLASS:
+			// Refined below, once we're done with the device path
+			IoProfile->Transport = TRANSPORT_USB2;
+			break;
+		case MSG_NODE_ATAPI:
+			IoProfile->Transport = TRANSPORT_ATA;
+			break;
+		case MSG_NODE_SATA:
+			IoProfile->Transport = TRANSPORT_SATA;
+			break;
+		case MSG_NODE_SCSI:
+			if (!IS_USB_TRANSPORT(IoProfile->Transport))
+				IoProfile->Transport = TRANSPORT_SCSI;
+			break;
+		case MSG_NODE_NVME:
+			IoProfile->Transport = TRANSPORT_NVME;
+			break;
+		case MSG_NODE_UFS:
+			IoProfile->Transport = TRANSPORT_UFS;
+			break;
+		case MSG_NODE_SD:
+			IoProfile->Transport = TRANSPORT_SD;
+			break;
+		case MSG_NODE_EMMC:
+			IoProfile->Transport = TRANSPORT_EMMC;
+			break;
+		default:
+			break;
+		}
+	}
+	if (IoProfile->Transport == TRANSPORT_USB2)
+		IoProfile->Transport = GetUsbTransport(DevicePath, &IoProfile->UsbMaxPacketSize);
+	IoProfile->TransferSize = TransportDefaults[IoProfile->Transport].TransferSize;
+	IoProfile->Alignment = 1;
+
+	Status = gBS->HandleProtocol(Handle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo);
+	if (EFI_ERROR(Status))
+		return Status;
+	if (BlockIo->Media->IoAlign > 1)
+		IoProfile->Alignment = BlockIo->Media->IoAlign;
+
+	// Round the transfer size to the granularity the device reports, if any
+	if ((BlockIo->Revision >= EFI_BLOCK_IO_PROTOCOL_REVISION3) &&
+		(BlockIo->Media->OptimalTransferLengthGranularity != 0)) {
+		Granularity = BlockIo->Media->OptimalTransferLengthGranularity * BlockIo->Media->BlockSize;
+		if ((Granularity != 0) && (Granularity <= MAX_TRANSFER_SIZE))
+			IoProfile->TransferSize = ((IoProfile->TransferSize + Granularity - 1) / Granularity) * Granularity;
+		IoProfile->LowestAlignedLba = BlockIo->Media->LowestAlignedLba;
+	}
+	if (IoProfile->TransferSize < BlockIo->Media->BlockSize)
+		IoProfile->TransferSize = BlockIo->Media->BlockSize;
+
+	return EFI_SUCCESS;
+}
+
+CONST CHAR16* GetTransportName(CONST TRANSPORT_TYPE Transport)
+{
+	return (Transport < TRANSPORT_MAX) ? TransportDefaults[Transport].Name : TransportDefaults[0].Name;
+}
+
+/*
+ * Allocate a buffer that satisfies the alignment requirements of a BlockIo
+ * device. Page alignment satisfies any IoAlign value we may encounter.
+ */
+VOID* AllocateIoBuffer(CONST UINTN Size, CONST UINT32 Alignment)
+{
+	EFI_PHYSICAL_ADDRESS Address;
+
+	if (Alignment <= 8)
+		return AllocatePool(Size);
+	if (gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+		EFI_SIZE_TO_PAGES(Size), &Address) != EFI_SUCCESS)
+		return NULL;
+	return (VOID*)(UINTN)Address;
+}
+
+VOID FreeIoBuffer(VOID* Buffer, CONST UINTN Size, CONST UINT32 Alignment)
+{
+	if (Buffer == NULL)
+		return;
+	if (Alignment <= 8)
+		FreePool(Buffer);
+	else
+		gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)Buffer, EFI_SIZE_TO_PAGES(Size));
+}
+
+#if FEATURE_DRIVER_PACK
+/*
+ * Measure how fast we can read from the disk a partition resides on, by
+ * timing sequential reads of THROUGHPUT_TEST_SIZE bytes. So that results
+ * can be compared, we read the whole disk rather than the partition, and
+ * always at the same location, which is past the partition tables and out
+ * of the partition, since we just read from it and the device may cache it.
+ * Returns the rate in KB/s, or 0 if the disk could not be read.
+ */
+#define THROUGHPUT_TEST_SIZE    (4 * 1024 * 1024)
+#define THROUGHPUT_TEST_OFFSET  (1024 * 1024)
+
+UINT32 MeasureThroughput(CONST EFI_HANDLE Handle, CONST IO_PROFILE* IoProfile)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH *DevicePath, *DiskPath, *RemainingDevicePath, *Node;
+	HARDDRIVE_DEVICE_PATH* Partition = NULL;
+	EFI_HANDLE DiskHandle;
+	EFI_BLOCK_IO_PROTOCOL* BlockIo;
+	UINT8* Buffer;
+	UINT64 Start, Elapsed, Total = 0;
+	UINT32 Alignment;
+	UINTN Size, BlockSize;
+	EFI_LBA Lba, Blocks;
+
+	DevicePath = DevicePathFromHandle(Handle);
+	if (DevicePath == NULL)
+		return 0;
+	for (Node = DevicePath; !IsDevicePathEnd(Node); Node = NextDevicePathNode(Node)) {
+		if ((DevicePathType(Node) == MEDIA_DEVICE_PATH) && (DevicePathSubType(Node) == MEDIA_HARDDRIVE_DP))
+			Partition = (HARDDRIVE_DEVICE_PATH*)Node;
+	}
+	DiskPath = GetParentDevice(DevicePath);
+	if (DiskPath == NULL)
+		return 0;
+	RemainingDevicePath = DiskPath;
+	Status = gBS->LocateDevicePath(&gEfiBlockIoProtocolGuid, &RemainingDevicePath, &DiskHandle);
+	if (!EFI_ERROR(Status) && !IsDevicePathEnd(RemainingDevicePath))
+		Status = EFI_NOT_FOUND;
+	FreePool(DiskPath);
+	if (EFI_ERROR(Status) ||
+		(gBS->HandleProtocol(DiskHandle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo) != EFI_SUCCESS) ||
+		BlockIo->Media->LogicalPartition)
+		return 0;
+
+	BlockSize = BlockIo->Media->BlockSize;
+	Size = ((IoProfile != NULL) && (IoProfile->TransferSize != 0)) ? IoProfile->TransferSize : MAX_TRANSFER_SIZE;
+	if ((BlockSize == 0) || (Size < BlockSize))
+		return 0;
+	Size -= Size % BlockSize;
+	Blocks = ((THROUGHPUT_TEST_SIZE + Size - 1) / Size) * (Size / BlockSize);
+	Lba = THROUGHPUT_TEST_OFFSET / BlockSize;
+	if ((Partition != NULL) && (Lba < Partition->PartitionStart + Partition->PartitionSize) &&
+		(Lba + Blocks > Partition->PartitionStart))
+		Lba = Partition->PartitionStart + Partition->PartitionSize;
+	if (Lba + Blocks > BlockIo->Media->LastBlock + 1)
+		return 0;
+	Alignment = (IoProfile != NULL) ? IoProfile->Alignment : 0;
+	if (BlockIo->Media->IoAlign > Alignment)
+		Alignment = BlockIo->Media->IoAlign;
+	Buffer = AllocateIoBuffer(Size, Alignment);
+	if (Buffer == NULL)
+		return 0;
+
+	Start = GetElapsedTime();
+	while (Total < THROUGHPUT_TEST_SIZE) {
+		if (BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, Lba, Size, Buffer) != EFI_SUCCESS)
+			break;
+		Lba += Size / BlockSize;
+		Total += Size;
+	}
+	Elapsed = GetElapsedTime() - Start;
+	FreeIoBuffer(Buffer, Size, Alignment);
+
+	// Bytes per millisecond are close enough to KB/s for our purpose
+	return (UINT32)DIV_U64(Total, (Elapsed == 0) ? 1 : (UINT32)Elapsed);
+}
+#endif
@@ -0,0 +1,183 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Leveled logging
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Size of the log ring buffer. Must be a power of two. */
+#define LOG_RING_SIZE       0x8000
+
+/* Where the log gets saved, on the boot volume */
+#define LOG_PATH            L"\\efi\\rufus\\uefi-ntfs.log"
+
+/* Messages at or below this level are displayed on the console */
+UINTN LogLevel = LOG_DEFAULT_LEVEL;
+
+static CONST CHAR16* LevelTag[] = { L"[FAIL]", L"[WARN]", L"[INFO]", L"[DBUG]", L"[TRCE]" };
+static CONST UINTN LevelColour[] = { TEXT_RED, TEXT_YELLOW, TEXT_WHITE, TEXT_DEFAULT, TEXT_DEFAULT };
+
+#if FEATURE_LOG_FILE
+/*
+ * Every message that was compiled in, whether it is displayed or not, is
+ * also recorded in the ring buffer, so that the full log can be retrieved
+ * later on. Once the buffer is full, the oldest messages are overwritten.
+ */
+static CHAR8 LogRing[LOG_RING_SIZE];
+static UINTN LogHead = 0;
+
+static CONST CHAR8 StampTemplate[] = "[    0.000] ";
+
+static __inline VOID LogPutc(CONST CHAR8 c)
+{
+	LogRing[LogHead++ & (LOG_RING_SIZE - 1)] = c;
+}
+
+/*
+ * Append a message to the ring buffer, as ASCII, prefixed with a timestamp.
+ * Reading the RTC for every line would be slow, and useless with its one
+ * second resolution, so we only add timestamps when we have a counter.
+ */
+static VOID LogAppend(CONST UINTN Level, CONST CHAR16* Message)
+{
+	CONST CHAR16* Tag = LevelTag[Level];
+	CHAR8 Stamp[sizeof(StampTemplate)];
+	UINT32 Time;
+	INTN i;
+
+	if (IsTimerPrecise()) {
+		Time = (UINT32)GetElapsedTime();
+		for (i = 0; i < (INTN)sizeof(Stamp); i++)
+			Stamp[i] = StampTemplate[i];
+		// Format the timestamp ourselves, as this is faster than the print library
+		for (i = 9; (i >= 1) && ((i >= 5) || (Time != 0)); i--) {
+			if (i == 6)
+				continue;
+			Stamp[i] = '0' + (CHAR8)(Time % 10);
+			Time /= 10;
+		}
+		for (i = 0; Stamp[i] != '\0'; i++)
+			LogPutc(Stamp[i]);
+	}
+	while (*Tag != L'\0')
+		LogPutc((CHAR8)*Tag++);
+	LogPutc(' ');
+	for (; *Message != L'\0'; Message++)
+		LogPutc((*Message < 0x80) ? (CHAR8)*Message : '?');
+	LogPutc('\n');
+}
+#endif
+
+/*
+ * Format a message, record it and, if its level is visible, print it.
+ * This should only ever be called through the Print###() macros, which
+ * take care of eliminating the calls above LOG_MAX_LEVEL altogether.
+ */
+VOID LogPrint(CONST UINTN Level, CONST CHAR16* Format, ...)
+{
+	CHAR16 Message[STRING_MAX];
+	VA_LIST Args;
+
+	// Don't pay for the formatting of a message that goes nowhere
+	if ((Level > LOG_TRACE) || !IsLogEmitted(Level))
+		return;
+
+	VA_START(Args, Format);
+	UnicodeVSPrint(Message, sizeof(Message), Format, Args);
+	VA_END(Args);
+
+#if FEATURE_LOG_FILE
+	LogAppend(Level, Message);
+#endif
+	if (Level > LogLevel)
+		return;
+	SetText(LevelColour[Level]);
+	Print(L"%s", LevelTag[Level]);
+	DefText();
+	Print(L" %s\n", Message);
+}
+
+/*
+ * Set the runtime log level from the load options we were invoked with,
+ * if any. '-v' increases the verbosity by one level, '-q' decreases it.
+ */
+VOID SetLogLevel(CONST CHAR16* Options, CONST UINTN Size)
+{
+	UINTN i, Len = Size / sizeof(CHAR16);
+
+	if (Options == NULL)
+		return;
+	for (i = 0; (i + 1 < Len) && (Options[i] != L'\0'); i++) {
+		if (Options[i] != L'-' || ((i > 0) && (Options[i - 1] != L' ')))
+			continue;
+		for (i++; (i < Len) && ((Options[i] == L'v') || (Options[i] == L'q')); i++) {
+			if ((Options[i] == L'v') && (LogLevel < LOG_TRACE))
+				LogLevel++;
+			else if ((Options[i] == L'q') && (LogLevel > LOG_ERROR))
+				LogLevel--;
+		}
+	}
+}
+
+#if FEATURE_LOG_FILE
+/*
+ * Return the content of the ring buffer as (up to) two parts, in
+ * chronological order. Returns the total size of the log.
+ */
+UINTN GetLog(CONST CHAR8** Part1, UINTN* Size1, CONST CHAR8** Part2, UINTN* Size2)
+{
+	UINTN Start = LogHead & (LOG_RING_SIZE - 1);
+
+	if (LogHead <= LOG_RING_SIZE) {
+		*Part1 = LogRing;
+		*Size1 = LogHead;
+		*Part2 = NULL;
+		*Size2 = 0;
+	} else {
+		*Part1 = &LogRing[Start];
+		*Size1 = LOG_RING_SIZE - Start;
+		*Part2 = LogRing;
+		*Size2 = Start;
+	}
+	return *Size1 + *Size2;
+}
+
+/*
+ * Write the whole log to the boot volume. This is the only time the log
+ * incurs any file I/O, so it should only be called once we're done.
+ */
+EFI_STATUS SaveLog(CONST EFI_FILE_HANDLE Root)
+{
+	EFI_STATUS Status;
+	CONST CHAR8 *Part1, *Part2;
+	UINTN Size1, Size2;
+	CHAR8* Buffer;
+
+	if (Root == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	GetLog(&Part1, &Size1, &Part2, &Size2);
+	Buffer = AllocatePool(Size1 + Size2);
+	if (Buffer == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	CopyMem(Buffer, Part1, Size1);
+	if (Size2 != 0)
+		CopyMem(&Buffer[Size1], Part2, Size2);
+	Status = WriteFileData(Root, LOG_PATH, Buffer, Size1 + Size2);
+	FreePool(Buffer);
+	return Status;
+}
+#endif
@@ -0,0 +1,283 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - File system metadata cache
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_METADATA_CACHE
+/*
+ * While we look up paths with SetPathCase() and open files, the file system
+ * driver reads the same MFT records, index blocks or directory clusters over
+ * and over, through the DiskIo of the partition, and each of these reads is a
+ * round trip to what usually is a slow USB device. So, before the driver binds
+ * to the partition, we insert a small set associative cache into its DiskIo,
+ * for reads that are the size of file system metadata. Larger reads, which are
+ * file data, go straight to the disk.
+ */
+#define METADATA_LINE_SHIFT     12
+#define METADATA_LINE_SIZE      (1 << METADATA_LINE_SHIFT)
+#define METADATA_SETS           128
+#define METADATA_WAYS           4
+#define METADATA_MAX_READ       METADATA_LINE_SIZE
+
+typedef struct {
+	UINT64  Tag;
+	UINT32  LastUse;
+	BOOLEAN Valid;
+} CACHE_LINE;
+
+/* Not all of the environments we build with use the same names for these */
+typedef EFI_STATUS (EFIAPI *DISK_READ_EX)(EFI_DISK_IO2_PROTOCOL* This, UINT32 MediaId,
+	UINT64 Offset, EFI_DISK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer);
+typedef EFI_STATUS (EFIAPI *DISK_WRITE_EX)(EFI_DISK_IO2_PROTOCOL* This, UINT32 MediaId,
+	UINT64 Offset, EFI_DISK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer);
+
+static EFI_BLOCK_IO_MEDIA* Media = NULL;
+static EFI_DISK_IO_PROTOCOL* DiskIo = NULL;
+static EFI_DISK_IO2_PROTOCOL* DiskIo2 = NULL;
+static EFI_DISK_READ OrgReadDisk;
+static EFI_DISK_WRITE OrgWriteDisk;
+static DISK_READ_EX OrgReadDiskEx;
+static DISK_WRITE_EX OrgWriteDiskEx;
+
+static CACHE_LINE Line[METADATA_SETS][METADATA_WAYS];
+static UINT8* LineData = NULL;
+static UINT32 MediaId, Tick = 0;
+static UINT32 Hits = 0, Misses = 0, Bypassed = 0;
+
+static VOID FlushCache(VOID)
+{
+	ZeroMem(Line, sizeof(Line));
+}
+
+/*
+ * Get the cached copy of a line, reading it from the disk if needed.
+ * Returns NULL if the line can't be cached, or could not be read.
+ */
+static UINT8* GetLine(CONST UINT64 Tag)
+{
+	CONST UINTN Set = (UINTN)Tag & (METADATA_SETS - 1);
+	UINT64 MediaSize;
+	UINTN Way, Victim = METADATA_WAYS;
+	UINT8* Data;
+
+	for (Way = 0; Way < METADATA_WAYS; Way++) {
+		if (Line[Set][Way].Valid && (Line[Set][Way].Tag == Tag)) {
+			Line[Set][Way].LastUse = ++Tick;
+			Hits++;
+			return &LineData[(Set * METADATA_WAYS + Way) * METADATA_LINE_SIZE];
+		}
+		if (!Line[Set][Way].Valid && (Victim == METADATA_WAYS))
+			Victim = Way;
+	}
+	// No unused way => replace the least recently used one
+	if (Victim == METADATA_WAYS) {
+		for (Way = 1, Victim = 0; Way < METADATA_WAYS; Way++) {
+			if (Line[Set][Way].LastUse < Line[Set][Victim].LastUse)
+				Victim = Way;
+		}
+	}
+
+	// Lines that straddle the end of the partition are not cached
+	MediaSize = MultU64x32(Media->LastBlock + 1, Media->BlockSize);
+	if (LShiftU64(Tag + 1, METADATA_LINE_SHIFT) > MediaSize)
+		return NULL;
+
+	Misses++;
+	Line[Set][Victim].Valid = FALSE;
+	Data = &LineData[(Set * METADATA_WAYS + Victim) * METADATA_LINE_SIZE];
+	if (OrgReadDisk(DiskIo, MediaId, LShiftU64(Tag, METADATA_LINE_SHIFT), METADATA_LINE_SIZE, Data) != EFI_SUCCESS)
+		return NULL;
+	Line[Set][Victim].Tag = Tag;
+	Line[Set][Victim].LastUse = ++Tick;
+	Line[Set][Victim].Valid = TRUE;
+	return Data;
+}
+
+/* Serve a metadata sized read from the cache. Returns FALSE if the read must go to the disk. */
+static BOOLEAN ReadFromCache(CONST UINT32 Id, UINT64 Offset, UINTN BufferSize, UINT8* Buffer)
+{
+	UINT8* Data;
+	UINTN Start, Size;
+
+	if ((BufferSize == 0) || (BufferSize > METADATA_MAX_READ)) {
+		Bypassed++;
+		return FALSE;
+	}
+	// The media changed under us => start over
+	if (Media->MediaId != MediaId) {
+		FlushCache();
+		MediaId = Media->MediaId;
+	}
+	// Let the disk report the error for a stale media ID
+	if (Id != MediaId)
+		return FALSE;
+
+	// A read that is not aligned may span two lines
+	for (; BufferSize > 0; BufferSize -= Size, Offset += Size, Buffer += Size) {
+		Data = GetLine(RShiftU64(Offset, METADATA_LINE_SHIFT));
+		if (Data == NULL)
+			return FALSE;
+		Start = (UINTN)Offset & (METADATA_LINE_SIZE - 1);
+		Size = METADATA_LINE_SIZE - Start;
+		if (Size > BufferSize)
+			Size = BufferSize;
+		CopyMem(Buffer, &Data[Start], Size);
+	}
+	return TRUE;
+}
+
+/* Drop the lines that overlap with data being written */
+static VOID InvalidateCache(CONST UINT64 Offset, CONST UINTN BufferSize)
+{
+	UINT64 Tag, End = RShiftU64(Offset + BufferSize + METADATA_LINE_SIZE - 1, METADATA_LINE_SHIFT);
+	UINTN Set, Way;
+
+	// Large writes would take longer to walk tag by tag than to flush everything
+	if (End - RShiftU64(Offset, METADATA_LINE_SHIFT) > METADATA_SETS) {
+		FlushCache();
+		return;
+	}
+	for (Tag = RShiftU64(Offset, METADATA_LINE_SHIFT); Tag < End; Tag++) {
+		Set = (UINTN)Tag & (METADATA_SETS - 1);
+		for (Way = 0; Way < METADATA_WAYS; Way++) {
+			if (Line[Set][Way].Tag == Tag)
+				Line[Set][Way].Valid = FALSE;
+		}
+	}
+}
+
+static EFI_STATUS EFIAPI CachedReadDisk(EFI_DISK_IO_PROTOCOL* This, UINT32 Id,
+	UINT64 Offset, UINTN BufferSize, VOID* Buffer)
+{
+	if (ReadFromCache(Id, Offset, BufferSize, (UINT8*)Buffer))
+		return EFI_SUCCESS;
+	return OrgReadDisk(This, Id, Offset, BufferSize, Buffer);
+}
+
+static EFI_STATUS EFIAPI CachedWriteDisk(EFI_DISK_IO_PROTOCOL* This, UINT32 Id,
+	UINT64 Offset, UINTN BufferSize, VOID* Buffer)
+{
+	InvalidateCache(Offset, BufferSize);
+	return OrgWriteDisk(This, Id, Offset, BufferSize, Buffer);
+}
+
+/*
+ * DiskIo2 reads are served from the cache when they can be, but a miss is
+ * passed on as is, rather than turned into a blocking read of the line.
+ */
+static EFI_STATUS EFIAPI CachedReadDiskEx(EFI_DISK_IO2_PROTOCOL* This, UINT32 Id,
+	UINT64 Offset, EFI_DISK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer)
+{
+	BOOLEAN Blocking = (Token == NULL) || (Token->Event == NULL);
+
+	if (!Blocking || !ReadFromCache(Id, Offset, BufferSize, (UINT8*)Buffer))
+		return OrgReadDiskEx(This, Id, Offset, Token, BufferSize, Buffer);
+	if (Token != NULL)
+		Token->TransactionStatus = EFI_SUCCESS;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI CachedWriteDiskEx(EFI_DISK_IO2_PROTOCOL* This, UINT32 Id,
+	UINT64 Offset, EFI_DISK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer)
+{
+	InvalidateCache(Offset, BufferSize);
+	return OrgWriteDiskEx(This, Id, Offset, Token, BufferSize, Buffer);
+}
+
+/*
+ * Install our cache on the DiskIo (and DiskIo2) of the target partition.
+ * This must be done before the file system driver binds to it.
+ */
+EFI_STATUS StartMetadataCache(CONST EFI_HANDLE TargetHandle)
+{
+	EFI_STATUS Status;
+	EFI_BLOCK_IO_PROTOCOL* BlockIo;
+
+	if (DiskIo != NULL)
+		return EFI_ALREADY_STARTED;
+
+	Status = gBS->HandleProtocol(TargetHandle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = gBS->HandleProtocol(TargetHandle, &gEfiDiskIoProtocolGuid, (VOID**)&DiskIo);
+	if (EFI_ERROR(Status)) {
+		DiskIo = NULL;
+		return Status;
+	}
+	if (gBS->HandleProtocol(TargetHandle, &gEfiDiskIo2ProtocolGuid, (VOID**)&DiskIo2) != EFI_SUCCESS)
+		DiskIo2 = NULL;
+
+	LineData = AllocatePool(METADATA_SETS * METADATA_WAYS * METADATA_LINE_SIZE);
+	if (LineData == NULL) {
+		DiskIo = NULL;
+		DiskIo2 = NULL;
+		return EFI_OUT_OF_RESOURCES;
+	}
+	FlushCache();
+	Media = BlockIo->Media;
+	MediaId = Media->MediaId;
+	Hits = Misses = Bypassed = 0;
+
+	OrgReadDisk = DiskIo->ReadDisk;
+	OrgWriteDisk = DiskIo->WriteDisk;
+	DiskIo->ReadDisk = CachedReadDisk;
+	DiskIo->WriteDisk = CachedWriteDisk;
+	if (DiskIo2 != NULL) {
+		OrgReadDiskEx = DiskIo2->ReadDiskEx;
+		OrgWriteDiskEx = DiskIo2->WriteDiskEx;
+		DiskIo2->ReadDiskEx = CachedReadDiskEx;
+		DiskIo2->WriteDiskEx = CachedWriteDiskEx;
+	}
+	PrintDebug(L"  Metadata cache: %d KB, %d-way", METADATA_SETS * METADATA_WAYS * METADATA_LINE_SIZE / 1024, METADATA_WAYS);
+	return EFI_SUCCESS;
+}
+
+/* Log how well the cache did so far */
+VOID ReportMetadataCache(VOID)
+{
+	if (DiskIo == NULL)
+		return;
+	PrintDebug(L"Metadata cache: %d hit(s), %d miss(es), %d large read(s)", Hits, Misses, Bypassed);
+}
+
+/* Get the counters of the cache, for telemetry */
+VOID GetMetadataCacheStats(UINT32* HitCount, UINT32* MissCount, UINT32* BypassCount)
+{
+	*HitCount = Hits;
+	*MissCount = Misses;
+	*BypassCount = Bypassed;
+}
+
+/* Remove our cache, which must be done before we exit */
+VOID StopMetadataCache(VOID)
+{
+	if (DiskIo != NULL) {
+		DiskIo->ReadDisk = OrgReadDisk;
+		DiskIo->WriteDisk = OrgWriteDisk;
+		DiskIo = NULL;
+	}
+	if (DiskIo2 != NULL) {
+		DiskIo2->ReadDiskEx = OrgReadDiskEx;
+		DiskIo2->WriteDiskEx = OrgWriteDiskEx;
+		DiskIo2 = NULL;
+	}
+	if (LineData != NULL)
+		SafeFree(LineData);
+	Media = NULL;
+}
+#endif
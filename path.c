@@ -106,6 +106,55 @@ INTN CompareDevicePaths(CONST EFI_DEVICE_PATH *dp1, CONST EFI_DEVICE_PATH *dp2)
 	return 0;
 }
 
+/*
+ * Set up a view of a device path, which records the size of both the whole
+ * path and its parent (i.e. the path without its last node), so that equality
+ * and parent checks can be done without allocating. Device paths are short,
+ * so a bounded CompareMem() after a size check is cheaper than hashing them.
+ */
+VOID InitDevicePathView(DEVICE_PATH_VIEW* View, CONST EFI_DEVICE_PATH* DevicePath)
+{
+	CONST EFI_DEVICE_PATH* dp = DevicePath;
+	UINTN NodeLen;
+
+	V_ASSERT(View != NULL);
+	View->DevicePath = DevicePath;
+	View->Size = 0;
+	View->ParentSize = 0;
+	if (dp == NULL)
+		return;
+
+	while (!IsDevicePathEndType(dp)) {
+		NodeLen = DevicePathNodeLength(dp);
+		// Guard against malformed nodes, that would have us loop forever
+		if (NodeLen < sizeof(EFI_DEVICE_PATH))
+			break;
+		View->ParentSize = View->Size;
+		View->Size += NodeLen;
+		dp = (CONST EFI_DEVICE_PATH*)((CONST UINT8*)dp + NodeLen);
+	}
+}
+
+/* Check if two device paths are the same */
+BOOLEAN IsSameDevicePath(CONST DEVICE_PATH_VIEW* View1, CONST DEVICE_PATH_VIEW* View2)
+{
+	if ((View1->DevicePath == NULL) || (View2->DevicePath == NULL))
+		return FALSE;
+	if (View1->Size != View2->Size)
+		return FALSE;
+	return (CompareMem(View1->DevicePath, View2->DevicePath, View1->Size) == 0);
+}
+
+/* Check if Parent is the device path of the direct parent of Child */
+BOOLEAN IsParentDevicePath(CONST DEVICE_PATH_VIEW* Parent, CONST DEVICE_PATH_VIEW* Child)
+{
+	if ((Parent->DevicePath == NULL) || (Child->DevicePath == NULL) || (Child->Size == 0))
+		return FALSE;
+	if (Child->ParentSize != Parent->Size)
+		return FALSE;
+	return (CompareMem(Parent->DevicePath, Child->DevicePath, Parent->Size) == 0);
+}
+
 /* Fix the case of a path by looking it up on the file system */
 EFI_STATUS SetPathCase(CONST EFI_FILE_HANDLE Root, CHAR16* Path)
 {
@@ -167,40 +216,279 @@ out:
 	return Status;
 }
 
+/* Return the index of the last backslash in a path */
+static UINTN GetDirLength(CONST CHAR16* Path)
+{
+	UINTN i;
+
+	for (i = SafeStrLen(Path); (i != 0) && (Path[i] != L'\\'); i--);
+	return i;
+}
+
+/* Lookup state of path candidates */
+#define CANDIDATE_UNKNOWN   0
+#define CANDIDATE_PENDING   1
+#define CANDIDATE_MISSING   2
+#define CANDIDATE_FOUND     3
+
+/*
+ * Find the first of an ordered list of files that exists, and fix its case.
+ * Rather than walking the path of each candidate in turn, each directory is
+ * only ever enumerated once, with all the candidates it may contain matched
+ * during that single enumeration.
+ * Candidates must be modifiable and are case corrected in place.
+ */
+EFI_STATUS FindFirstPath(CONST EFI_FILE_HANDLE Root, CHAR16** Candidates, CONST UINTN Count, UINTN* Index)
+{
+	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE DirHandle;
+	EFI_FILE_INFO* FileInfo;
+	UINT8 State[MAX_PATH_CANDIDATES];
+	UINTN i, j, Len, Size;
+
+	if ((Root == NULL) || (Candidates == NULL) || (Index == NULL) || (Count > MAX_PATH_CANDIDATES))
+		return EFI_INVALID_PARAMETER;
+
+	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
+	if (FileInfo == NULL)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (i = 0; i < Count; i++)
+		State[i] = CANDIDATE_UNKNOWN;
+
+	for (i = 0; i < Count; i++) {
+		if (State[i] == CANDIDATE_UNKNOWN) {
+			Len = GetDirLength(Candidates[i]);
+			// Mark all the candidates that share this directory
+			for (j = i; j < Count; j++) {
+				if ((State[j] != CANDIDATE_UNKNOWN) || (GetDirLength(Candidates[j]) != Len))
+					continue;
+				Candidates[i][Len] = 0;
+				Candidates[j][Len] = 0;
+				if (_StriCmp(Candidates[i], Candidates[j]) == 0)
+					State[j] = CANDIDATE_PENDING;
+				Candidates[i][Len] = L'\\';
+				Candidates[j][Len] = L'\\';
+			}
+
+			// Fix the case of the directory, then enumerate it
+			DirHandle = NULL;
+			Candidates[i][Len] = 0;
+			Status = (Len == 0) ? EFI_SUCCESS : SetPathCase(Root, Candidates[i]);
+			if (!EFI_ERROR(Status))
+				Status = Root->Open(Root, &DirHandle, (Len == 0) ? L"\\" : Candidates[i], EFI_FILE_MODE_READ, 0);
+			Candidates[i][Len] = L'\\';
+			if (!EFI_ERROR(Status)) {
+				DirHandle->SetPosition(DirHandle, 0);
+				do {
+					Size = FileInfoSize;
+					ZeroMem(FileInfo, Size);
+					Status = DirHandle->Read(DirHandle, &Size, (VOID*)FileInfo);
+					if (EFI_ERROR(Status) || (Size == 0) || (FileInfo->Attribute & EFI_FILE_DIRECTORY))
+						continue;
+					for (j = i; j < Count; j++) {
+						if ((State[j] == CANDIDATE_PENDING) &&
+							(_StriCmp(&Candidates[j][Len + 1], FileInfo->FileName) == 0)) {
+							CopyMem(Candidates[j], Candidates[i], Len * sizeof(CHAR16));
+							SafeStrCpy(&Candidates[j][Len + 1], PATH_MAX - Len - 1, FileInfo->FileName);
+							State[j] = CANDIDATE_FOUND;
+						}
+					}
+				} while ((Size != 0) && !EFI_ERROR(Status));
+				DirHandle->Close(DirHandle);
+			}
+			for (j = i; j < Count; j++) {
+				if (State[j] == CANDIDATE_PENDING)
+					State[j] = CANDIDATE_MISSING;
+			}
+		}
+		if (State[i] == CANDIDATE_FOUND) {
+			*Index = i;
+			FreePool(FileInfo);
+			return EFI_SUCCESS;
+		}
+	}
+
+	FreePool(FileInfo);
+	return EFI_NOT_FOUND;
+}
+
+/*
+ * Open the root directory of the file system that resides on DeviceHandle.
+ */
+EFI_STATUS OpenRoot(CONST EFI_HANDLE DeviceHandle, EFI_FILE_HANDLE* Root)
+{
+	EFI_STATUS Status;
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume;
+
+	if (Root == NULL)
+		return EFI_INVALID_PARAMETER;
+	*Root = NULL;
+
+	Status = gBS->HandleProtocol(DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID**)&Volume);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	Status = Volume->OpenVolume(Volume, Root);
+	if (!EFI_ERROR(Status) && (*Root == NULL))
+		Status = EFI_NOT_FOUND;
+	return Status;
+}
+
+/*
+ * Read up to *Size bytes from a file into a caller provided buffer.
+ * On return, *Size is set to the number of bytes actually read.
+ */
+EFI_STATUS ReadFileData(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, VOID* Buffer, UINTN* Size)
+{
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File;
+
+	if ((Root == NULL) || (Path == NULL) || (Buffer == NULL) || (Size == NULL))
+		return EFI_INVALID_PARAMETER;
+
+	Status = Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = File->Read(File, Size, Buffer);
+	File->Close(File);
+	return Status;
+}
+
+/*
+ * Read a whole file into a newly allocated buffer, that must be freed by the caller.
+ * If Identity is not NULL, it is filled with what identifies this version of the file.
+ */
+EFI_STATUS ReadWholeFile(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, VOID** Buffer, UINTN* Size,
+	FILE_IDENTITY* Identity)
+{
+	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File;
+	EFI_FILE_INFO* FileInfo;
+	UINTN InfoSize = FileInfoSize;
+
+	if ((Root == NULL) || (Path == NULL) || (Buffer == NULL) || (Size == NULL))
+		return EFI_INVALID_PARAMETER;
+	*Buffer = NULL;
+
+	Status = Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
+	if (FileInfo == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	Status = File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, FileInfo);
+	// FileInfo is undefined on error, so nothing must be taken from it then
+	if (!EFI_ERROR(Status))
+		*Size = (UINTN)FileInfo->FileSize;
+	if (!EFI_ERROR(Status) && (Identity != NULL)) {
+		Identity->PathHash = Fnv1a64(FNV1A64_INIT, Path, StrLen(Path) * sizeof(CHAR16));
+		Identity->FileSize = FileInfo->FileSize;
+		Identity->PhysicalSize = FileInfo->PhysicalSize;
+		CopyMem(&Identity->CreateTime, &FileInfo->CreateTime, sizeof(EFI_TIME));
+		CopyMem(&Identity->ModificationTime, &FileInfo->ModificationTime, sizeof(EFI_TIME));
+		// Padding is not guaranteed to be zeroed, and must not be part of the identity
+		Identity->CreateTime.Pad1 = Identity->CreateTime.Pad2 = 0;
+		Identity->ModificationTime.Pad1 = Identity->ModificationTime.Pad2 = 0;
+	}
+	FreePool(FileInfo);
+	if (EFI_ERROR(Status))
+		goto out;
+
+	*Buffer = AllocatePool(*Size);
+	if (*Buffer == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	Status = File->Read(File, Size, *Buffer);
+	if (EFI_ERROR(Status))
+		SafeFree(*Buffer);
+
+out:
+	File->Close(File);
+	return Status;
+}
+
+/*
+ * Write a buffer to a file, in a single operation, creating or truncating
+ * the file as needed.
+ */
+EFI_STATUS WriteFileData(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, CONST VOID* Buffer, UINTN Size)
+{
+	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File;
+	EFI_FILE_INFO* FileInfo;
+	UINTN InfoSize;
+
+	if ((Root == NULL) || (Path == NULL) || (Buffer == NULL))
+		return EFI_INVALID_PARAMETER;
+
+	Status = Root->Open(Root, &File, (CHAR16*)Path,
+		EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	Status = File->Write(File, &Size, (VOID*)Buffer);
+	if (EFI_ERROR(Status))
+		goto out;
+
+	// If we overwrote a larger file, truncate it to the data we wrote
+	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
+	if (FileInfo != NULL) {
+		InfoSize = FileInfoSize;
+		if ((File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, FileInfo) == EFI_SUCCESS) &&
+			(FileInfo->FileSize > Size)) {
+			FileInfo->FileSize = Size;
+			Status = File->SetInfo(File, &gEfiFileInfoGuid, InfoSize, FileInfo);
+		}
+		FreePool(FileInfo);
+	}
+
+out:
+	File->Close(File);
+	return Status;
+}
+
+#if FEATURE_PATH_HEX
 /*
  * Poor man's Device Path to string conversion, where we
  * simply convert the path buffer to hexascii.
  * This is needed to support old Dell UEFI platforms, that
  * don't have the Device Path to Text protocol...
+ * Size is the size of Buffer, in characters. If that is too
+ * small, Size is updated with the required size.
  */
-CHAR16* DevicePathToHex(CONST EFI_DEVICE_PATH* DevicePath)
+EFI_STATUS DevicePathToHex(CONST EFI_DEVICE_PATH* DevicePath, CHAR16* Buffer, UINTN* Size)
 {
-	UINTN Len = 0, i;
-	CHAR16* DevicePathString = NULL;
-	UINT8* dp = (UINT8*)DevicePath;
+	static CONST CHAR16 HexDigit[] = L"0123456789ABCDEF";
+	DEVICE_PATH_VIEW View;
+	CONST UINT8* dp = (CONST UINT8*)DevicePath;
+	UINTN i;
 
-	if (DevicePath == NULL)
-		return NULL;
+	if ((DevicePath == NULL) || (Size == NULL))
+		return EFI_INVALID_PARAMETER;
 
-	while (!IsDevicePathEnd(DevicePath)) {
-		UINTN NodeLen = DevicePathNodeLength(DevicePath);
-		/* Device Paths are provided by UEFI and are sanitized. */
-		/* coverity[var_assign_var] */
-		Len += NodeLen;
-		DevicePath = (EFI_DEVICE_PATH*)((UINT8*)DevicePath + NodeLen);
+	InitDevicePathView(&View, DevicePath);
+	if ((Buffer == NULL) || (*Size < 2 * View.Size + 1)) {
+		*Size = 2 * View.Size + 1;
+		return EFI_BUFFER_TOO_SMALL;
 	}
 
-	DevicePathString = AllocatePool((2 * Len + 1) * sizeof(CHAR16));
-	for (i = 0; i < Len; i++) {
-		DevicePathString[2 * i] = ((dp[i] >> 4) < 10) ?
-			((dp[i] >> 4) + '0') : ((dp[i] >> 4) - 0xa + 'A');
-		DevicePathString[2 * i + 1] = ((dp[i] & 15) < 10) ?
-			((dp[i] & 15) + '0') : ((dp[i] & 15) - 0xa + 'A');
+	for (i = 0; i < View.Size; i++) {
+		Buffer[2 * i] = HexDigit[dp[i] >> 4];
+		Buffer[2 * i + 1] = HexDigit[dp[i] & 0x0F];
 	}
-	DevicePathString[2 * Len] = 0;
+	Buffer[2 * View.Size] = 0;
 
-	return DevicePathString;
+	return EFI_SUCCESS;
 }
+#endif
 
 /*
  * Convert a Device Path to a string.
@@ -208,22 +496,35 @@ CHAR16* DevicePathToHex(CONST EFI_DEVICE_PATH* DevicePath)
  */
 CHAR16* DevicePathToString(CONST EFI_DEVICE_PATH* DevicePath)
 {
+	/* The protocol lookup is only ever done once */
+	static EFI_DEVICE_PATH_TO_TEXT_PROTOCOL* DevicePathToText = NULL;
+	static BOOLEAN DevicePathToTextLookedUp = FALSE;
 	CHAR16* DevicePathString = NULL;
-	EFI_STATUS Status;
-	EFI_DEVICE_PATH_TO_TEXT_PROTOCOL* DevicePathToText;
+#if !defined(_GNU_EFI) && FEATURE_PATH_HEX
+	UINTN Size = 0;
+#endif
 
 	if (DevicePath == NULL)
 		return NULL;
 
 	/* On most platforms, the DevicePathToText protocol should be available */
-	Status = gBS->LocateProtocol(&gEfiDevicePathToTextProtocolGuid, NULL, (VOID**)&DevicePathToText);
-	if (Status == EFI_SUCCESS)
-		DevicePathString = DevicePathToText->ConvertDevicePathToText(DevicePath, FALSE, FALSE);
-	else
+	if (!DevicePathToTextLookedUp) {
+		if (gBS->LocateProtocol(&gEfiDevicePathToTextProtocolGuid, NULL, (VOID**)&DevicePathToText) != EFI_SUCCESS)
+			DevicePathToText = NULL;
+		DevicePathToTextLookedUp = TRUE;
+	}
+
+	if (DevicePathToText != NULL)
+		return DevicePathToText->ConvertDevicePathToText(DevicePath, FALSE, FALSE);
+
 #if defined(_GNU_EFI)
-		DevicePathString = DevicePathToStr((EFI_DEVICE_PATH*)DevicePath);
-#else
-		DevicePathString = DevicePathToHex(DevicePath);
+	DevicePathString = DevicePathToStr((EFI_DEVICE_PATH*)DevicePath);
+#elif FEATURE_PATH_HEX
+	if (DevicePathToHex(DevicePath, NULL, &Size) == EFI_BUFFER_TOO_SMALL) {
+		DevicePathString = AllocatePool(Size * sizeof(CHAR16));
+		if ((DevicePathString != NULL) && (DevicePathToHex(DevicePath, DevicePathString, &Size) != EFI_SUCCESS))
+			SafeFree(DevicePathString);
+	}
 #endif
 	return DevicePathString;
 }
@@ -0,0 +1,302 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - PE header inspection
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* How much of the start of the file we read, to get to the PE headers */
+#define PE_HEADER_READ_SIZE     1024
+
+/* How much of the security directory we look at, to find the certificate issuer */
+#define PE_CERT_READ_SIZE       4096
+
+#define DOS_SIGNATURE           0x5A4D		/* "MZ" */
+#define PE_SIGNATURE            0x00004550	/* "PE\0\0" */
+#define PE32_MAGIC              0x10B
+#define PE32PLUS_MAGIC          0x20B
+#define PE_SECURITY_DIRECTORY   4
+
+/* Offsets in the PE optional header */
+#define PE_SIZE_OF_HEADERS_OFFSET 60
+#define PE_CHECKSUM_OFFSET      64
+#define PE_SUBSYSTEM_OFFSET     68
+#define PE32_DIRECTORY_OFFSET   92
+#define PE32PLUS_DIRECTORY_OFFSET 108
+
+/* Size of a section header */
+#define PE_SECTION_SIZE         40
+
+/*
+ * Location of the PE header fields we are interested in, validated
+ * against the size of the buffer they were parsed from. SecurityEntry
+ * and SectionTable are 0 when they don't reside in the buffer.
+ */
+typedef struct {
+	UINT32  FileHeader;		/* Offset of the COFF file header */
+	UINT32  OptionalHeader;		/* Offset of the optional header */
+	UINT32  SecurityEntry;		/* Offset of the security data directory entry */
+	UINT32  SectionTable;		/* Offset of the section table */
+	UINT16  NumberOfSections;
+	UINT32  SizeOfHeaders;
+} PE_HEADERS;
+
+/* Machine types we can run */
+#if defined(_M_X64) || defined(__x86_64__)
+  static CONST UINT16 NativeMachine[] = { 0x8664 };
+#elif defined(_M_IX86) || defined(__i386__)
+  static CONST UINT16 NativeMachine[] = { 0x014C };
+#elif defined (_M_ARM64) || defined(__aarch64__)
+  static CONST UINT16 NativeMachine[] = { 0xAA64 };
+#elif defined (_M_ARM) || defined(__arm__)
+  static CONST UINT16 NativeMachine[] = { 0x01C2, 0x01C4 };
+#elif defined(_M_RISCV64) || (defined (__riscv) && (__riscv_xlen == 64))
+  static CONST UINT16 NativeMachine[] = { 0x5064 };
+#elif  defined(_M_LOONGARCH64) || defined(__loongarch64)
+  static CONST UINT16 NativeMachine[] = { 0x6264 };
+#else
+#  error Unsupported architecture
+#endif
+
+/*
+ * The issuers of the certificates that are trusted by the default Secure
+ * Boot db of most platforms, for third party UEFI executables.
+ */
+static CONST CHAR8* TrustedIssuer[] = {
+	"Microsoft Corporation UEFI CA 2011",
+	"Microsoft UEFI CA 2023",
+	"Microsoft Option ROM UEFI CA 2023",
+};
+
+static __inline UINT16 GetU16(CONST UINT8* p) { return (UINT16)(p[0] | (p[1] << 8)); }
+static __inline UINT32 GetU32(CONST UINT8* p) { return (UINT32)GetU16(p) | ((UINT32)GetU16(&p[2]) << 16); }
+
+/*
+ * Locate the PE headers in a buffer. Only the parts of the headers that
+ * reside in the buffer are validated, and the ones that don't (which can
+ * happen since GetPeInfo() only reads the start of the file) are cleared.
+ */
+static EFI_STATUS ParsePeHeaders(CONST UINT8* Buffer, CONST UINTN Size, PE_HEADERS* Headers)
+{
+	UINT32 PeOffset, DirOffset, DirCount;
+
+	if ((Size < 0x40) || (GetU16(Buffer) != DOS_SIGNATURE))
+		return EFI_LOAD_ERROR;
+	PeOffset = GetU32(&Buffer[0x3C]);
+	if ((PeOffset > Size - 24) || (GetU32(&Buffer[PeOffset]) != PE_SIGNATURE))
+		return EFI_LOAD_ERROR;
+	Headers->FileHeader = PeOffset + 4;
+	Headers->OptionalHeader = Headers->FileHeader + 20;
+	if ((UINTN)Headers->OptionalHeader + PE32PLUS_DIRECTORY_OFFSET + 4 > Size)
+		return EFI_LOAD_ERROR;
+	switch (GetU16(&Buffer[Headers->OptionalHeader])) {
+	case PE32_MAGIC:
+		DirOffset = PE32_DIRECTORY_OFFSET;
+		break;
+	case PE32PLUS_MAGIC:
+		DirOffset = PE32PLUS_DIRECTORY_OFFSET;
+		break;
+	default:
+		return EFI_LOAD_ERROR;
+	}
+	DirCount = GetU32(&Buffer[Headers->OptionalHeader + DirOffset]);
+	Headers->SecurityEntry = (DirCount > PE_SECURITY_DIRECTORY) ?
+		Headers->OptionalHeader + DirOffset + 4 + PE_SECURITY_DIRECTORY * 8 : 0;
+	if ((UINTN)Headers->SecurityEntry + 8 > Size)
+		Headers->SecurityEntry = 0;
+	Headers->NumberOfSections = GetU16(&Buffer[Headers->FileHeader + 2]);
+	Headers->SectionTable = Headers->OptionalHeader + GetU16(&Buffer[Headers->FileHeader + 16]);
+	if ((UINTN)Headers->SectionTable + (UINTN)Headers->NumberOfSections * PE_SECTION_SIZE > Size) {
+		Headers->SectionTable = 0;
+		Headers->NumberOfSections = 0;
+	}
+	Headers->SizeOfHeaders = GetU32(&Buffer[Headers->OptionalHeader + PE_SIZE_OF_HEADERS_OFFSET]);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Read the PE headers of an executable, and the start of its security
+ * directory if it has one, without reading the rest of the image.
+ */
+EFI_STATUS GetPeInfo(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, PE_INFO* Info)
+{
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File = NULL;
+	UINT8* Buffer;
+	PE_HEADERS Headers;
+	UINTN i, Size = PE_HEADER_READ_SIZE;
+
+	if ((Root == NULL) || (Path == NULL) || (Info == NULL))
+		return EFI_INVALID_PARAMETER;
+	ZeroMem(Info, sizeof(PE_INFO));
+
+	Buffer = AllocatePool(PE_CERT_READ_SIZE);
+	if (Buffer == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	Status = Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(Status))
+		goto out;
+	Status = File->Read(File, &Size, Buffer);
+	if (EFI_ERROR(Status))
+		goto out;
+
+	Status = ParsePeHeaders(Buffer, Size, &Headers);
+	if (EFI_ERROR(Status))
+		goto out;
+	Info->Machine = GetU16(&Buffer[Headers.FileHeader]);
+	Info->Subsystem = GetU16(&Buffer[Headers.OptionalHeader + PE_SUBSYSTEM_OFFSET]);
+	if (Headers.SecurityEntry != 0) {
+		Info->SecurityOffset = GetU32(&Buffer[Headers.SecurityEntry]);
+		Info->SecuritySize = GetU32(&Buffer[Headers.SecurityEntry + 4]);
+	}
+	for (i = 0; i < ARRAY_SIZE(NativeMachine); i++) {
+		if (Info->Machine == NativeMachine[i])
+			Info->NativeMachine = TRUE;
+	}
+	Status = EFI_SUCCESS;
+
+	// The issuer of the signing certificate is near the start of the signature
+	if ((Info->SecurityOffset != 0) && (Info->SecuritySize != 0)) {
+		Size = (Info->SecuritySize < PE_CERT_READ_SIZE) ? Info->SecuritySize : PE_CERT_READ_SIZE;
+		if ((File->SetPosition(File, Info->SecurityOffset) == EFI_SUCCESS) &&
+			(File->Read(File, &Size, Buffer) == EFI_SUCCESS)) {
+			for (i = 0; (i < ARRAY_SIZE(TrustedIssuer)) && !Info->TrustedIssuer; i++)
+				Info->TrustedIssuer = FindMem(Buffer, Size, TrustedIssuer[i], _AsciiStrLen(TrustedIssuer[i]));
+		}
+	}
+
+out:
+	if (File != NULL)
+		File->Close(File);
+	FreePool(Buffer);
+	return Status;
+}
+
+#if FEATURE_PREFLIGHT
+/*
+ * Return the signature data (PKCS#7 SignedData) of an image, from the
+ * first WIN_CERTIFICATE of its security directory.
+ */
+EFI_STATUS GetPeSignature(CONST UINT8* Image, CONST UINTN Size, CONST UINT8** Signature, UINTN* SignatureSize)
+{
+	PE_HEADERS Headers;
+	UINT32 Offset, Length;
+
+	if (EFI_ERROR(ParsePeHeaders(Image, Size, &Headers)) || (Headers.SecurityEntry == 0))
+		return EFI_LOAD_ERROR;
+	Offset = GetU32(&Image[Headers.SecurityEntry]);
+	Length = GetU32(&Image[Headers.SecurityEntry + 4]);
+	if ((Offset == 0) || (Length < 8) || (Offset > Size) || (Length > Size - Offset))
+		return EFI_NOT_FOUND;
+	// WIN_CERTIFICATE: dwLength, wRevision, wCertificateType, bCertificate[]
+	if ((GetU32(&Image[Offset]) < 8) || (GetU32(&Image[Offset]) > Length))
+		return EFI_LOAD_ERROR;
+	*Signature = &Image[Offset + 8];
+	*SignatureSize = GetU32(&Image[Offset]) - 8;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Return the raw data of the section called Name (e.g. ".sbat").
+ */
+EFI_STATUS GetPeSection(CONST UINT8* Image, CONST UINTN Size, CONST CHAR8* Name, CONST UINT8** Data, UINTN* DataSize)
+{
+	PE_HEADERS Headers;
+	CONST UINT8* Section;
+	UINT32 Offset, Length;
+	UINTN i, j;
+
+	if (EFI_ERROR(ParsePeHeaders(Image, Size, &Headers)))
+		return EFI_LOAD_ERROR;
+	if (Headers.SectionTable == 0)
+		return EFI_LOAD_ERROR;
+	for (i = 0; i < Headers.NumberOfSections; i++) {
+		Section = &Image[Headers.SectionTable + i * PE_SECTION_SIZE];
+		for (j = 0; (j < 8) && (Name[j] != 0) && (Section[j] == (UINT8)Name[j]); j++);
+		if ((j == 8) || (Name[j] != 0) || (Section[j] != 0))
+			continue;
+		Length = GetU32(&Section[16]);
+		Offset = GetU32(&Section[20]);
+		if ((Offset > Size) || (Length > Size - Offset))
+			return EFI_LOAD_ERROR;
+		*Data = &Image[Offset];
+		*DataSize = Length;
+		return EFI_SUCCESS;
+	}
+	return EFI_NOT_FOUND;
+}
+
+/*
+ * Compute the Authenticode SHA-256 digest of an image, as per the
+ * "Windows Authenticode Portable Executable Signature Format", which is
+ * what db and dbx image hashes are made of.
+ */
+EFI_STATUS GetAuthenticodeHash(CONST UINT8* Image, CONST UINTN Size, UINT8* Digest)
+{
+	SHA256_CONTEXT Context;
+	PE_HEADERS Headers;
+	CONST UINT8 *Section, *Other;
+	UINT32 Checksum, CertOffset = 0, CertSize = 0, Offset, Length;
+	UINTN i, j, Hashed, Last = 0;
+
+	if (EFI_ERROR(ParsePeHeaders(Image, Size, &Headers)) || (Headers.SecurityEntry == 0) ||
+		(Headers.SizeOfHeaders > Size) || (Headers.SizeOfHeaders < (UINTN)Headers.SecurityEntry + 8) ||
+		(Headers.SectionTable == 0))
+		return EFI_LOAD_ERROR;
+	Checksum = Headers.OptionalHeader + PE_CHECKSUM_OFFSET;
+	CertOffset = GetU32(&Image[Headers.SecurityEntry]);
+	CertSize = GetU32(&Image[Headers.SecurityEntry + 4]);
+	if ((CertSize > Size) || ((CertSize != 0) && (CertOffset > Size - CertSize)))
+		return EFI_LOAD_ERROR;
+
+	// Headers, minus the checksum and the security directory entry
+	Sha256Init(&Context);
+	Sha256Update(&Context, Image, Checksum);
+	Sha256Update(&Context, &Image[Checksum + 4], Headers.SecurityEntry - Checksum - 4);
+	Sha256Update(&Context, &Image[Headers.SecurityEntry + 8], Headers.SizeOfHeaders - Headers.SecurityEntry - 8);
+	Hashed = Headers.SizeOfHeaders;
+
+	// Sections, in the order of their file offset. There are few sections, so
+	// rather than sorting them, we look for the next one on each iteration.
+	for (i = 0; i < Headers.NumberOfSections; i++) {
+		Section = NULL;
+		for (j = 0; j < Headers.NumberOfSections; j++) {
+			Other = &Image[Headers.SectionTable + j * PE_SECTION_SIZE];
+			Offset = GetU32(&Other[20]);
+			if ((GetU32(&Other[16]) == 0) || ((i != 0) && (Offset <= Last)))
+				continue;
+			if ((Section == NULL) || (Offset < GetU32(&Section[20])))
+				Section = Other;
+		}
+		if (Section == NULL)
+			break;
+		Length = GetU32(&Section[16]);
+		Offset = GetU32(&Section[20]);
+		if ((Offset > Size) || (Length > Size - Offset))
+			return EFI_LOAD_ERROR;
+		Sha256Update(&Context, &Image[Offset], Length);
+		Hashed += Length;
+		Last = Offset;
+	}
+
+	// Any data past the sections, minus the signature
+	if (Size > Hashed + CertSize)
+		Sha256Update(&Context, &Image[Hashed], Size - Hashed - CertSize);
+
+	Sha256Final(&Context, Digest);
+	return EFI_SUCCESS;
+}
+#endif
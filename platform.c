@@ -0,0 +1,194 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Platform state snapshot
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/*
+ * On some firmwares, every GetVariable() call goes through SMM and can take
+ * milliseconds, so we read the variables we need once, into a snapshot that
+ * serves all of our queries. We also skip the variables that can't matter:
+ * the Secure Boot modes when the firmware doesn't do Secure Boot at all, and
+ * the signature databases, which are large, when Secure Boot is not enforced.
+ */
+#define UEFI_REVISION_2_5       ((2 << 16) | 50)
+
+/* Initial buffer sizes, that are large enough to read these in a single call on most systems */
+#define DB_SIZE_HINT            (8 * 1024)
+#define DBX_SIZE_HINT           (32 * 1024)
+#define SBAT_LEVEL_SIZE_HINT    256
+#define BOOT_ORDER_MAX          64
+
+static PLATFORM_STATE State;
+static BOOLEAN StateRead = FALSE;
+
+/* Read a single byte variable. Returns FALSE if it doesn't exist. */
+static BOOLEAN ReadByteVariable(CONST CHAR16* Name, EFI_GUID* Guid, UINT8* Value)
+{
+	UINTN Size = sizeof(*Value);
+
+	return (gRT->GetVariable((CHAR16*)Name, Guid, NULL, &Size, Value) == EFI_SUCCESS) && (Size == sizeof(*Value));
+}
+
+/* Read the variables that are small enough to always be part of the snapshot */
+static VOID ReadPlatformState(VOID)
+{
+	UINT16 BootOrder[BOOT_ORDER_MAX];
+	UINTN Size;
+
+	ZeroMem(&State, sizeof(State));
+	State.BootCurrent = 0xFFFF;
+	State.BootOrderFirst = 0xFFFF;
+	StateRead = TRUE;
+
+	// The "SecureBoot" variable indicates whether the platform firmware
+	// is operating in Secure Boot mode (1) or not (0). Without it, none
+	// of the other Secure Boot variables exist.
+	State.HasSecureBoot = ReadByteVariable(L"SecureBoot", &gEfiGlobalVariableGuid, &State.SecureBoot);
+	if (State.HasSecureBoot) {
+		ReadByteVariable(L"SetupMode", &gEfiGlobalVariableGuid, &State.SetupMode);
+		// Audit and Deployed modes were introduced with UEFI 2.5
+		if (gST->Hdr.Revision >= UEFI_REVISION_2_5) {
+			ReadByteVariable(L"AuditMode", &gEfiGlobalVariableGuid, &State.AuditMode);
+			ReadByteVariable(L"DeployedMode", &gEfiGlobalVariableGuid, &State.DeployedMode);
+		}
+	}
+
+	Size = sizeof(State.BootCurrent);
+	if (gRT->GetVariable(L"BootCurrent", &gEfiGlobalVariableGuid, NULL, &Size, &State.BootCurrent) != EFI_SUCCESS)
+		State.BootCurrent = 0xFFFF;
+	// We only need the head of the boot order, so a buffer that is too small is fine
+	Size = sizeof(BootOrder);
+	switch (gRT->GetVariable(L"BootOrder", &gEfiGlobalVariableGuid, NULL, &Size, BootOrder)) {
+	case EFI_SUCCESS:
+		if (Size >= sizeof(UINT16))
+			State.BootOrderFirst = BootOrder[0];
+		// Fall through
+	case EFI_BUFFER_TOO_SMALL:
+		State.BootOrderCount = Size / sizeof(UINT16);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Get the snapshot of the platform variables, which is taken on first use.
+ */
+CONST PLATFORM_STATE* GetPlatformState(VOID)
+{
+	if (!StateRead)
+		ReadPlatformState();
+	return &State;
+}
+
+#if FEATURE_SYSTEM_INFO
+/*
+ * Report the parts of the snapshot that are useful to diagnose boot issues.
+ */
+VOID PrintPlatformState(VOID)
+{
+	GetPlatformState();
+	if (State.HasSecureBoot)
+		PrintDebug(L"Secure Boot modes: Setup %d, Audit %d, Deployed %d",
+			State.SetupMode, State.AuditMode, State.DeployedMode);
+	if (State.BootCurrent != 0xFFFF)
+		PrintDebug(L"Started from Boot%04X%s (%d boot option(s))", State.BootCurrent,
+			(State.BootCurrent == State.BootOrderFirst) ? L"" : L", out of boot order", State.BootOrderCount);
+}
+#endif
+
+#if FEATURE_PREFLIGHT
+/*
+ * GUIDs for the Secure Boot databases and the shim revocations. Not all of
+ * these are provided by the environments we build with, so we use our own.
+ */
+static EFI_GUID ImageSecurityDatabaseGuid =
+	{ 0xd719b2cb, 0x3d3a, 0x4596, { 0xa3, 0xbc, 0xda, 0xd0, 0x0e, 0x67, 0x65, 0x6f } };
+static EFI_GUID ShimLockGuid =
+	{ 0x605dab50, 0xe046, 0x4300, { 0xab, 0xb6, 0x3d, 0xd8, 0x10, 0xdd, 0x8b, 0x23 } };
+
+/*
+ * Read a whole variable into a newly allocated buffer, starting with a
+ * buffer of SizeHint bytes, so that we usually need a single call.
+ */
+static UINT8* ReadVariable(CONST CHAR16* Name, EFI_GUID* Guid, CONST UINTN SizeHint, UINTN* Size)
+{
+	EFI_STATUS Status;
+	UINT8* Data;
+
+	*Size = SizeHint;
+	Data = AllocatePool(*Size);
+	if (Data == NULL)
+		goto out;
+	Status = gRT->GetVariable((CHAR16*)Name, Guid, NULL, Size, Data);
+	if (Status == EFI_BUFFER_TOO_SMALL) {
+		FreePool(Data);
+		Data = AllocatePool(*Size);
+		if (Data == NULL)
+			goto out;
+		Status = gRT->GetVariable((CHAR16*)Name, Guid, NULL, Size, Data);
+	}
+	if (EFI_ERROR(Status) || (*Size == 0))
+		SafeFree(Data);
+
+out:
+	if (Data == NULL)
+		*Size = 0;
+	return Data;
+}
+
+/*
+ * Add the Secure Boot databases to the snapshot. As this can take a while,
+ * this should be called when we are waiting on the firmware anyway, but it
+ * is also called by the consumers of the databases, in case we never did.
+ */
+VOID ReadSecureBootDatabases(VOID)
+{
+	UINT64 Start;
+
+	GetPlatformState();
+	if (State.HasDatabases)
+		return;
+	State.HasDatabases = TRUE;
+	// Only an enforcing Secure Boot ever needs them
+	if (!State.HasSecureBoot || (State.SecureBoot == 0) || (State.SetupMode != 0))
+		return;
+
+	Start = GetElapsedTime();
+	State.Db = ReadVariable(L"db", &ImageSecurityDatabaseGuid, DB_SIZE_HINT, &State.DbSize);
+	State.Dbx = ReadVariable(L"dbx", &ImageSecurityDatabaseGuid, DBX_SIZE_HINT, &State.DbxSize);
+	// SbatLevel is only accessible before ExitBootServices, which is our case
+	State.SbatLevel = (CHAR8*)ReadVariable(L"SbatLevel", &ShimLockGuid, SBAT_LEVEL_SIZE_HINT, &State.SbatLevelSize);
+	if (State.SbatLevel == NULL)
+		State.SbatLevel = (CHAR8*)ReadVariable(L"SbatLevelRT", &ShimLockGuid, SBAT_LEVEL_SIZE_HINT, &State.SbatLevelSize);
+	PrintDebug(L"Read db (%d bytes), dbx (%d bytes) and SBAT level (%d bytes) in %d ms",
+		State.DbSize, State.DbxSize, State.SbatLevelSize, (UINTN)(GetElapsedTime() - Start));
+}
+#endif
+
+/* Release the snapshot */
+VOID FreePlatformState(VOID)
+{
+	if (State.Db != NULL)
+		SafeFree(State.Db);
+	if (State.Dbx != NULL)
+		SafeFree(State.Dbx);
+	if (State.SbatLevel != NULL)
+		SafeFree(State.SbatLevel);
+	StateRead = FALSE;
+}
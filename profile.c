@@ -0,0 +1,178 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Per-platform boot profiles
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/*
+ * The profile table is a small fixed size file that lives on the FAT boot
+ * partition, next to the driver. It records, for each platform we booted
+ * on with this media, the settings that worked and how long each phase took. It is read
+ * once at startup and written once, at the end of the boot process.
+ */
+#define PROFILE_PATH        L"\\efi\\rufus\\uefi-ntfs.dat"
+#define PROFILE_MAGIC       0x464F5250	/* "PROF" */
+#define PROFILE_VERSION     2
+#define PROFILE_ENTRIES     32
+#define PROFILE_PHASES      8
+
+#pragma pack(push, 1)
+typedef struct {
+	UINT64  Key;
+	UINT32  Flags;
+	UINT32  BestTime;
+	UINT16  Boots;
+	UINT16  Failures;
+	UINT32  PhaseTime[PROFILE_PHASES];
+} PROFILE_ENTRY;
+
+typedef struct {
+	UINT32  Magic;
+	UINT16  Version;
+	UINT16  Count;
+	PROFILE_ENTRY Entry[PROFILE_ENTRIES];
+} PROFILE_TABLE;
+#pragma pack(pop)
+
+/* Reset a profile to the settings we use on platforms we know nothing about */
+static VOID SetDefaultProfile(BOOT_PROFILE* Profile)
+{
+	Profile->Flags = 0;
+	Profile->Boots = 0;
+	Profile->FellBack = FALSE;
+}
+
+#if FEATURE_PROFILES
+/* Entries are kept in most recently used order */
+static PROFILE_TABLE Table;
+static BOOLEAN Saved = FALSE;
+
+/*
+ * Look up the profile for the current platform and boot media.
+ * Profile is always initialized, with defaults if no profile exists.
+ */
+EFI_STATUS LoadProfile(CONST EFI_FILE_HANDLE Root, CONST EFI_DEVICE_PATH* BootPath, BOOT_PROFILE* Profile)
+{
+	EFI_STATUS Status;
+	DEVICE_PATH_VIEW View;
+	UINTN Index, Size = sizeof(Table);
+
+	V_ASSERT(PHASE_MAX <= PROFILE_PHASES);
+	V_ASSERT(Profile != NULL);
+
+	// Whether drivers block our target depends on the media as much as on the
+	// platform, so the path of the boot partition, which includes the signature
+	// of its disk, is part of the key.
+	InitDevicePathView(&View, BootPath);
+	Profile->Key = Fnv1a64(GetPlatformKey(), View.DevicePath, View.Size);
+	SetDefaultProfile(Profile);
+
+	Status = ReadFileData(Root, PROFILE_PATH, &Table, &Size);
+	if (EFI_ERROR(Status) || (Size != sizeof(Table)) || (Table.Magic != PROFILE_MAGIC) ||
+		(Table.Version != PROFILE_VERSION) || (Table.Count > PROFILE_ENTRIES)) {
+		ZeroMem(&Table, sizeof(Table));
+		Table.Magic = PROFILE_MAGIC;
+		Table.Version = PROFILE_VERSION;
+		return EFI_ERROR(Status) ? Status : EFI_VOLUME_CORRUPTED;
+	}
+
+	for (Index = 0; Index < Table.Count; Index++) {
+		if (Table.Entry[Index].Key != Profile->Key)
+			continue;
+		// A failed boot resets the entry to defaults, so we can apply it as is
+		Profile->Flags = Table.Entry[Index].Flags;
+		Profile->Boots = Table.Entry[Index].Boots;
+		return EFI_SUCCESS;
+	}
+
+	return EFI_NOT_FOUND;
+}
+
+/*
+ * Record the outcome of the current boot, along with the settings we used,
+ * and write the profile table back. This is only ever done once per boot.
+ */
+EFI_STATUS SaveProfile(CONST EFI_FILE_HANDLE Root, CONST BOOT_PROFILE* Profile, CONST BOOLEAN Success)
+{
+	PROFILE_ENTRY Entry;
+	UINTN Index, Phase;
+	UINT32 Total = 0;
+
+	if ((Root == NULL) || (Profile == NULL))
+		return EFI_INVALID_PARAMETER;
+	if (Saved)
+		return EFI_ALREADY_STARTED;
+	Saved = TRUE;
+
+	// Pull our entry out of the table, or create a new one
+	for (Index = 0; (Index < Table.Count) && (Table.Entry[Index].Key != Profile->Key); Index++);
+	if (Index < Table.Count) {
+		CopyMem(&Entry, &Table.Entry[Index], sizeof(Entry));
+	} else {
+		ZeroMem(&Entry, sizeof(Entry));
+		Entry.Key = Profile->Key;
+		if (Table.Count < PROFILE_ENTRIES)
+			Table.Count++;
+		// Evict the least recently used entry
+		Index = Table.Count - 1;
+	}
+	// Move everything before it down, so that our entry becomes the first
+	for (; Index > 0; Index--)
+		CopyMem(&Table.Entry[Index], &Table.Entry[Index - 1], sizeof(PROFILE_ENTRY));
+
+	for (Phase = 0; Phase < PHASE_MAX; Phase++)
+		Total += GetPhaseTime((BOOT_PHASE)Phase);
+
+	if (Success) {
+		if (Entry.Boots < 0xFFFF)
+			Entry.Boots++;
+		Entry.Failures = 0;
+		// Only switch strategies if the new one is faster than the best we know of,
+		// unless the one we knew of had to be reverted, as it no longer works
+		if ((Entry.BestTime == 0) || Profile->FellBack || (Entry.Flags == Profile->Flags) ||
+			(Total < Entry.BestTime)) {
+			Entry.Flags = Profile->Flags;
+			Entry.BestTime = Total;
+			for (Phase = 0; Phase < PHASE_MAX; Phase++)
+				Entry.PhaseTime[Phase] = GetPhaseTime((BOOT_PHASE)Phase);
+		}
+	} else {
+		// Whatever we learned did not work => start over with defaults
+		if (Entry.Failures < 0xFFFF)
+			Entry.Failures++;
+		Entry.Flags = 0;
+		Entry.BestTime = 0;
+	}
+	CopyMem(&Table.Entry[0], &Entry, sizeof(Entry));
+
+	return WriteFileData(Root, PROFILE_PATH, &Table, sizeof(Table));
+}
+#else
+/* Without profiles, every platform gets the default settings */
+EFI_STATUS LoadProfile(CONST EFI_FILE_HANDLE Root, CONST EFI_DEVICE_PATH* BootPath, BOOT_PROFILE* Profile)
+{
+	V_ASSERT(Profile != NULL);
+	Profile->Key = 0;
+	SetDefaultProfile(Profile);
+	return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS SaveProfile(CONST EFI_FILE_HANDLE Root, CONST BOOT_PROFILE* Profile, CONST BOOLEAN Success)
+{
+	return EFI_UNSUPPORTED;
+}
+#endif
@@ -0,0 +1,416 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Windows boot files read-ahead
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_READAHEAD
+/*
+ * Once Windows bootmgr is started, most of the time is spent pulling the
+ * RAM disk files (boot.sdi and boot.wim) through the firmware's BlockIo, in
+ * fairly small chunks. So, before we start bootmgr, we read these files in
+ * large chunks, and keep the blocks they are made of in memory, behind the
+ * BlockIo of the disk, so that the reads from bootmgr are served from memory.
+ *
+ * UEFI file systems do not tell where the data of a file is located, so we
+ * find out by recording the blocks the disk is asked for while we read the
+ * files through the file system, which also takes care of the file system
+ * metadata that bootmgr will need to read.
+ */
+#define BCD_PATH                L"\\efi\\microsoft\\boot\\bcd"
+#define READ_AHEAD_FILES        4
+#define READ_AHEAD_EXTENTS      1024
+#define READ_AHEAD_MAX_SIZE     (1024 * 1024 * 1024)
+#define READ_AHEAD_MIN_SIZE     (16 * 1024 * 1024)
+/* Room for the file system metadata, that gets recorded along with the data */
+#define READ_AHEAD_SLACK        (4 * 1024 * 1024)
+
+typedef struct {
+	EFI_LBA Lba;
+	UINTN   Blocks;
+	UINT8*  Data;
+} CACHE_EXTENT;
+
+static EFI_BLOCK_IO_PROTOCOL* BlockIo = NULL;
+static EFI_BLOCK_IO2_PROTOCOL* BlockIo2 = NULL;
+static EFI_BLOCK_READ OrgReadBlocks;
+static EFI_BLOCK_WRITE OrgWriteBlocks;
+static EFI_BLOCK_READ_EX OrgReadBlocksEx;
+static EFI_BLOCK_WRITE_EX OrgWriteBlocksEx;
+
+static UINT8* CacheBuffer = NULL;
+static UINTN CacheSize = 0, CacheUsed = 0;
+static CACHE_EXTENT Extent[READ_AHEAD_EXTENTS];
+static UINTN ExtentCount = 0;
+static BOOLEAN Recording = FALSE;
+
+/* Find the extent that holds a block, or return ExtentCount if there isn't one */
+static UINTN FindExtent(CONST EFI_LBA Lba)
+{
+	UINTN i;
+
+	for (i = 0; (i < ExtentCount) && !((Lba >= Extent[i].Lba) && (Lba < Extent[i].Lba + Extent[i].Blocks)); i++);
+	return i;
+}
+
+/* Check that a range of blocks is cached, possibly across multiple extents */
+static BOOLEAN IsCached(EFI_LBA Lba, UINTN Blocks)
+{
+	UINTN i, Count;
+
+	for (; Blocks > 0; Blocks -= Count, Lba += Count) {
+		i = FindExtent(Lba);
+		if (i >= ExtentCount)
+			return FALSE;
+		Count = (UINTN)(Extent[i].Lba + Extent[i].Blocks - Lba);
+		if (Count > Blocks)
+			Count = Blocks;
+	}
+	return TRUE;
+}
+
+/* Copy a range of blocks from the cache, if the whole range is cached */
+static BOOLEAN ReadFromCache(CONST UINT32 MediaId, EFI_LBA Lba, CONST UINTN BufferSize, UINT8* Buffer)
+{
+	CONST UINT32 BlockSize = BlockIo->Media->BlockSize;
+	UINTN i, Blocks, Count;
+
+	if ((ExtentCount == 0) || (MediaId != BlockIo->Media->MediaId) ||
+		(BufferSize == 0) || (BufferSize % BlockSize != 0) || !IsCached(Lba, BufferSize / BlockSize))
+		return FALSE;
+
+	for (Blocks = BufferSize / BlockSize; Blocks > 0; Blocks -= Count, Lba += Count) {
+		i = FindExtent(Lba);
+		Count = (UINTN)(Extent[i].Lba + Extent[i].Blocks - Lba);
+		if (Count > Blocks)
+			Count = Blocks;
+		CopyMem(Buffer, &Extent[i].Data[(UINTN)(Lba - Extent[i].Lba) * BlockSize], Count * BlockSize);
+		Buffer += Count * BlockSize;
+	}
+	return TRUE;
+}
+
+/*
+ * Add blocks that were just read from the disk to the cache. Once the cache
+ * runs out of space or extents, recording stops, since whatever we read next
+ * would not be cached anyway.
+ */
+static VOID AddToCache(CONST EFI_LBA Lba, CONST UINTN BufferSize, CONST UINT8* Buffer)
+{
+	CONST UINT32 BlockSize = BlockIo->Media->BlockSize;
+	CACHE_EXTENT* Last = (ExtentCount == 0) ? NULL : &Extent[ExtentCount - 1];
+
+	if (BufferSize > CacheSize - CacheUsed) {
+		Recording = FALSE;
+		return;
+	}
+	// Blocks we already have are typically metadata that is read again and again
+	if ((BufferSize % BlockSize != 0) || IsCached(Lba, BufferSize / BlockSize))
+		return;
+
+	// Reads of a file we stream are usually contiguous, so try to extend the last extent
+	if ((Last != NULL) && (Last->Lba + Last->Blocks == Lba) &&
+		(&Last->Data[Last->Blocks * BlockSize] == &CacheBuffer[CacheUsed])) {
+		Last->Blocks += BufferSize / BlockSize;
+	} else if (ExtentCount < READ_AHEAD_EXTENTS) {
+		Extent[ExtentCount].Lba = Lba;
+		Extent[ExtentCount].Blocks = BufferSize / BlockSize;
+		Extent[ExtentCount].Data = &CacheBuffer[CacheUsed];
+		ExtentCount++;
+	} else {
+		Recording = FALSE;
+		return;
+	}
+	CopyMem(&CacheBuffer[CacheUsed], Buffer, BufferSize);
+	CacheUsed += BufferSize;
+}
+
+/* Drop any cached extent that overlaps with blocks being written */
+static VOID InvalidateCache(CONST EFI_LBA Lba, CONST UINTN BufferSize)
+{
+	EFI_LBA End = Lba + (BufferSize + BlockIo->Media->BlockSize - 1) / BlockIo->Media->BlockSize;
+	UINTN i;
+
+	for (i = 0; i < ExtentCount; i++) {
+		if ((Lba < Extent[i].Lba + Extent[i].Blocks) && (End > Extent[i].Lba))
+			Extent[i].Blocks = 0;
+	}
+}
+
+static EFI_STATUS EFIAPI CachedReadBlocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, UINTN BufferSize, VOID* Buffer)
+{
+	EFI_STATUS Status;
+
+	if (ReadFromCache(MediaId, Lba, BufferSize, (UINT8*)Buffer))
+		return EFI_SUCCESS;
+	Status = OrgReadBlocks(This, MediaId, Lba, BufferSize, Buffer);
+	if (Recording && (Status == EFI_SUCCESS))
+		AddToCache(Lba, BufferSize, (UINT8*)Buffer);
+	return Status;
+}
+
+static EFI_STATUS EFIAPI CachedWriteBlocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, UINTN BufferSize, VOID* Buffer)
+{
+	InvalidateCache(Lba, BufferSize);
+	return OrgWriteBlocks(This, MediaId, Lba, BufferSize, Buffer);
+}
+
+/*
+ * BlockIo2 reads are only ever served, and never recorded, since their data
+ * is not available when they return.
+ */
+static EFI_STATUS EFIAPI CachedReadBlocksEx(EFI_BLOCK_IO2_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer)
+{
+	if (!ReadFromCache(MediaId, Lba, BufferSize, (UINT8*)Buffer))
+		return OrgReadBlocksEx(This, MediaId, Lba, Token, BufferSize, Buffer);
+	if ((Token != NULL) && (Token->Event != NULL)) {
+		Token->TransactionStatus = EFI_SUCCESS;
+		gBS->SignalEvent(Token->Event);
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI CachedWriteBlocksEx(EFI_BLOCK_IO2_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer)
+{
+	InvalidateCache(Lba, BufferSize);
+	return OrgWriteBlocksEx(This, MediaId, Lba, Token, BufferSize, Buffer);
+}
+
+/*
+ * Find the paths of the RAM disk files in a BCD. Rather than parse the registry
+ * hive, we look for the UTF-16 paths ending in ".sdi" or ".wim" it contains,
+ * whether they are stored as strings or as part of a device element.
+ */
+static UINTN GetBcdPaths(CONST UINT8* Bcd, CONST UINTN Size, CHAR16 Path[READ_AHEAD_FILES][PATH_MAX])
+{
+	CONST CHAR16* Str;
+	UINTN i, j, Start, Len, Count = 0;
+	BOOLEAN Duplicate;
+
+	for (i = 8; (i + 5 * sizeof(CHAR16) <= Size) && (Count < READ_AHEAD_FILES); i += sizeof(CHAR16)) {
+		Str = (CONST CHAR16*)&Bcd[i];
+		if ((Str[0] != L'.') || (Str[4] != 0) ||
+			!(((Str[1] | 0x20) == L's' && (Str[2] | 0x20) == L'd' && (Str[3] | 0x20) == L'i') ||
+			  ((Str[1] | 0x20) == L'w' && (Str[2] | 0x20) == L'i' && (Str[3] | 0x20) == L'm')))
+			continue;
+		// Walk back to the start of the string, then to the first backslash
+		for (Start = i; (Start >= sizeof(CHAR16)) && (i - Start < (PATH_MAX - 5) * sizeof(CHAR16)); Start -= sizeof(CHAR16)) {
+			Str = (CONST CHAR16*)&Bcd[Start - sizeof(CHAR16)];
+			if ((*Str < 0x20) || (*Str > 0x7E))
+				break;
+		}
+		for (; (Start < i) && (*(CONST CHAR16*)&Bcd[Start] != L'\\'); Start += sizeof(CHAR16));
+		if (Start >= i)
+			continue;
+		Len = (i - Start) / sizeof(CHAR16) + 4;
+		CopyMem(Path[Count], &Bcd[Start], Len * sizeof(CHAR16));
+		Path[Count][Len] = 0;
+		for (j = 0, Duplicate = FALSE; (j < Count) && !Duplicate; j++)
+			Duplicate = (StrCmp(Path[j], Path[Count]) == 0);
+		if (!Duplicate)
+			Count++;
+	}
+	return Count;
+}
+
+/*
+ * Install our cache on the BlockIo (and BlockIo2) of the disk that holds
+ * the target partition.
+ */
+static EFI_STATUS HookBlockIo(CONST EFI_HANDLE TargetHandle)
+{
+	EFI_STATUS Status;
+	EFI_DEVICE_PATH *ParentPath, *DevicePath;
+	EFI_HANDLE Handle = TargetHandle;
+
+	ParentPath = GetParentDevice(DevicePathFromHandle(TargetHandle));
+	if (ParentPath != NULL) {
+		DevicePath = ParentPath;
+		if (gBS->LocateDevicePath(&gEfiBlockIoProtocolGuid, &DevicePath, &Handle) != EFI_SUCCESS)
+			Handle = TargetHandle;
+		FreePool(ParentPath);
+	}
+	Status = gBS->HandleProtocol(Handle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo);
+	if (EFI_ERROR(Status))
+		return Status;
+	if (gBS->HandleProtocol(Handle, &gEfiBlockIo2ProtocolGuid, (VOID**)&BlockIo2) != EFI_SUCCESS)
+		BlockIo2 = NULL;
+
+	OrgReadBlocks = BlockIo->ReadBlocks;
+	OrgWriteBlocks = BlockIo->WriteBlocks;
+	BlockIo->ReadBlocks = CachedReadBlocks;
+	BlockIo->WriteBlocks = CachedWriteBlocks;
+	if (BlockIo2 != NULL) {
+		OrgReadBlocksEx = BlockIo2->ReadBlocksEx;
+		OrgWriteBlocksEx = BlockIo2->WriteBlocksEx;
+		BlockIo2->ReadBlocksEx = CachedReadBlocksEx;
+		BlockIo2->WriteBlocksEx = CachedWriteBlocksEx;
+	}
+	return EFI_SUCCESS;
+}
+
+/* Read a file through the file system, until the cache stops recording */
+static UINT64 StreamFile(CONST EFI_FILE_HANDLE Root, CONST CHAR16* Path, UINT8* Buffer, CONST UINTN BufferSize)
+{
+	EFI_FILE_HANDLE File;
+	UINT64 Total = 0;
+	UINTN Size;
+
+	if (Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, 0) != EFI_SUCCESS)
+		return 0;
+	do {
+		Size = BufferSize;
+		if (File->Read(File, &Size, Buffer) != EFI_SUCCESS)
+			break;
+		Total += Size;
+	} while ((Size == BufferSize) && Recording && (CacheSize - CacheUsed >= BufferSize));
+	File->Close(File);
+	return Total;
+}
+
+/*
+ * Read the RAM disk files listed in the BCD of the target partition into
+ * our BlockIo cache, within a memory budget that leaves Windows plenty of
+ * room for the RAM disk itself.
+ */
+EFI_STATUS StartReadAhead(CONST EFI_HANDLE TargetHandle, CONST EFI_FILE_HANDLE Root, CONST IO_PROFILE* IoProfile)
+{
+	// SetPathCase() needs a modifiable path
+	static CHAR16 BcdPath[] = BCD_PATH;
+	CHAR16 Path[READ_AHEAD_FILES][PATH_MAX];
+	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_PHYSICAL_ADDRESS Address;
+	EFI_FILE_HANDLE File;
+	EFI_FILE_INFO* FileInfo = NULL;
+	UINT8 *Bcd = NULL, *Buffer = NULL;
+	UINT64 FreePages, LargestFree, Total = 0, Start;
+	UINTN i, Count, BcdSize, InfoSize, TransferSize;
+
+	if ((Root == NULL) || (IoProfile == NULL))
+		return EFI_INVALID_PARAMETER;
+	if (CacheBuffer != NULL)
+		return EFI_ALREADY_STARTED;
+
+	Status = SetPathCase(Root, BcdPath);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = ReadWholeFile(Root, BcdPath, (VOID**)&Bcd, &BcdSize, NULL);
+	if (EFI_ERROR(Status))
+		return Status;
+	Count = GetBcdPaths(Bcd, BcdSize, Path);
+	FreePool(Bcd);
+	if (Count == 0)
+		return EFI_NOT_FOUND;
+
+	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
+	if (FileInfo == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	for (i = 0; i < Count; i++) {
+		if ((SetPathCase(Root, Path[i]) != EFI_SUCCESS) ||
+			(Root->Open(Root, &File, Path[i], EFI_FILE_MODE_READ, 0) != EFI_SUCCESS))
+			continue;
+		InfoSize = FileInfoSize;
+		if (File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, FileInfo) == EFI_SUCCESS) {
+			PrintDebug(L"  BCD references '%s' (%ld KB)", Path[i], DIV_U64(FileInfo->FileSize, 1024));
+			Total += FileInfo->FileSize;
+		}
+		File->Close(File);
+	}
+	FreePool(FileInfo);
+	if (Total == 0)
+		return EFI_NOT_FOUND;
+
+	// Never use more than a quarter of the free memory, or half of the largest free region
+	FreePages = GetFreeMemory(&LargestFree);
+	Total += READ_AHEAD_SLACK;
+	if (Total > READ_AHEAD_MAX_SIZE)
+		Total = READ_AHEAD_MAX_SIZE;
+	if (Total > LShiftU64(FreePages, EFI_PAGE_SHIFT - 2))
+		Total = LShiftU64(FreePages, EFI_PAGE_SHIFT - 2);
+	if (Total > LShiftU64(LargestFree, EFI_PAGE_SHIFT - 1))
+		Total = LShiftU64(LargestFree, EFI_PAGE_SHIFT - 1);
+	if (Total < READ_AHEAD_MIN_SIZE) {
+		PrintDebug(L"  Not enough memory for read-ahead");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	CacheSize = (UINTN)Total;
+	if (gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+		EFI_SIZE_TO_PAGES(CacheSize), &Address) != EFI_SUCCESS)
+		return EFI_OUT_OF_RESOURCES;
+	CacheBuffer = (UINT8*)(UINTN)Address;
+
+	TransferSize = (IoProfile->TransferSize != 0) ? IoProfile->TransferSize : MAX_TRANSFER_SIZE;
+	Buffer = AllocatePool(TransferSize);
+	if (Buffer == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	Status = HookBlockIo(TargetHandle);
+	if (EFI_ERROR(Status))
+		goto out;
+
+	Start = GetElapsedTime();
+	Recording = TRUE;
+	for (i = 0, Total = 0; (i < Count) && Recording && (CacheSize - CacheUsed >= TransferSize); i++)
+		Total += StreamFile(Root, Path[i], Buffer, TransferSize);
+	Recording = FALSE;
+	Start = GetElapsedTime() - Start;
+	PrintInfo(L"Read ahead %ld MB of Windows boot files in %ld ms", DIV_U64(Total, 1024 * 1024), Start);
+	PrintDebug(L"  %d extent(s), %ld KB cached", ExtentCount, DIV_U64(CacheUsed, 1024));
+
+out:
+	SafeFree(Buffer);
+	if (EFI_ERROR(Status)) {
+		gBS->FreePages(Address, EFI_SIZE_TO_PAGES(CacheSize));
+		CacheBuffer = NULL;
+	}
+	return Status;
+}
+
+/* Get how much data was read ahead, and in how many extents, for telemetry */
+UINT64 GetReadAheadStats(UINT32* Extents)
+{
+	*Extents = (UINT32)ExtentCount;
+	return CacheUsed;
+}
+
+/* Remove our cache, which must be done before we exit */
+VOID StopReadAhead(VOID)
+{
+	if (BlockIo != NULL) {
+		BlockIo->ReadBlocks = OrgReadBlocks;
+		BlockIo->WriteBlocks = OrgWriteBlocks;
+		BlockIo = NULL;
+	}
+	if (BlockIo2 != NULL) {
+		BlockIo2->ReadBlocksEx = OrgReadBlocksEx;
+		BlockIo2->WriteBlocksEx = OrgWriteBlocksEx;
+		BlockIo2 = NULL;
+	}
+	ExtentCount = 0;
+	if (CacheBuffer != NULL) {
+		gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)CacheBuffer, EFI_SIZE_TO_PAGES(CacheSize));
+		CacheBuffer = NULL;
+	}
+	CacheSize = CacheUsed = 0;
+}
+#endif
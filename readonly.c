@@ -0,0 +1,295 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Read-only target partition
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_READONLY
+/*
+ * Some file system drivers replay the NTFS journal or update the volume flags
+ * when they mount a volume, which, on cheap flash media, means synchronous
+ * writes that can stall for hundreds of milliseconds. Since all we need is to
+ * read a bootloader, we can present the target partition as read-only to the
+ * driver, through the BlockIo (and BlockIo2) it uses underneath its DiskIo.
+ * Drivers that ignore the read-only flag get their writes kept in an overlay
+ * in RAM, so that they read back what they wrote, without the media being
+ * modified. When the overlay is full, writes fail as write protected.
+ * Once the volume is mounted, the overlay is locked: it is still applied to
+ * reads, but new writes, including the ones from the bootloader, fail as
+ * write protected, rather than being reported as successful and then lost.
+ */
+#define OVERLAY_SIZE            (4 * 1024 * 1024)
+
+static EFI_BLOCK_IO_PROTOCOL* BlockIo = NULL;
+static EFI_BLOCK_IO2_PROTOCOL* BlockIo2 = NULL;
+static EFI_BLOCK_READ OrgReadBlocks;
+static EFI_BLOCK_WRITE OrgWriteBlocks;
+static EFI_BLOCK_READ_EX OrgReadBlocksEx;
+static EFI_BLOCK_WRITE_EX OrgWriteBlocksEx;
+static BOOLEAN OrgReadOnly;
+
+/* The overlay holds single blocks, in the order they were first written */
+static EFI_LBA* OverlayLba = NULL;
+static UINT8* OverlayData = NULL;
+static UINTN OverlayCount = 0, OverlayMax = 0;
+static EFI_LBA OverlayFirst, OverlayLast;
+static UINT32 Writes = 0, Rejected = 0;
+static UINT64 WriteSize = 0;
+static BOOLEAN Locked = FALSE;
+
+/* Find the overlay entry for a block, or return OverlayCount if there isn't one */
+static UINTN FindBlock(CONST EFI_LBA Lba)
+{
+	UINTN i;
+
+	for (i = 0; (i < OverlayCount) && (OverlayLba[i] != Lba); i++);
+	return i;
+}
+
+/* Replace the data we just read from the media with the blocks that were written over */
+static VOID ApplyOverlay(EFI_LBA Lba, CONST UINTN BufferSize, UINT8* Buffer)
+{
+	CONST UINT32 BlockSize = BlockIo->Media->BlockSize;
+	EFI_LBA End = Lba + BufferSize / BlockSize;
+	UINTN i;
+
+	if ((OverlayCount == 0) || (Lba > OverlayLast) || (End <= OverlayFirst))
+		return;
+	for (; Lba < End; Lba++, Buffer += BlockSize) {
+		i = FindBlock(Lba);
+		if (i < OverlayCount)
+			CopyMem(Buffer, &OverlayData[i * BlockSize], BlockSize);
+	}
+}
+
+/* Check if any of a range of blocks was written over */
+static BOOLEAN IsOverlaid(EFI_LBA Lba, CONST UINTN BufferSize)
+{
+	EFI_LBA End = Lba + BufferSize / BlockIo->Media->BlockSize;
+
+	if ((OverlayCount == 0) || (Lba > OverlayLast) || (End <= OverlayFirst))
+		return FALSE;
+	for (; Lba < End; Lba++) {
+		if (FindBlock(Lba) < OverlayCount)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Keep a write in the overlay, all or nothing */
+static EFI_STATUS WriteToOverlay(CONST UINT32 MediaId, EFI_LBA Lba, CONST UINTN BufferSize, CONST UINT8* Buffer)
+{
+	CONST UINT32 BlockSize = BlockIo->Media->BlockSize;
+	EFI_LBA End;
+	UINTN i, New = 0;
+
+	Writes++;
+	WriteSize += BufferSize;
+	if (Locked) {
+		Rejected++;
+		return EFI_WRITE_PROTECTED;
+	}
+	if (MediaId != BlockIo->Media->MediaId)
+		return EFI_MEDIA_CHANGED;
+	if (BufferSize % BlockSize != 0)
+		return EFI_BAD_BUFFER_SIZE;
+	End = Lba + BufferSize / BlockSize;
+	if (End > BlockIo->Media->LastBlock + 1)
+		return EFI_INVALID_PARAMETER;
+
+	if (OverlayData == NULL) {
+		OverlayMax = OVERLAY_SIZE / BlockSize;
+		OverlayLba = AllocatePool(OverlayMax * sizeof(EFI_LBA));
+		OverlayData = AllocatePool(OVERLAY_SIZE);
+		if ((OverlayLba == NULL) || (OverlayData == NULL)) {
+			SafeFree(OverlayLba);
+			SafeFree(OverlayData);
+			OverlayMax = 0;
+		}
+	}
+	for (i = 0; i < BufferSize / BlockSize; i++) {
+		if (FindBlock(Lba + i) >= OverlayCount)
+			New++;
+	}
+	if (OverlayCount + New > OverlayMax) {
+		Rejected++;
+		return EFI_WRITE_PROTECTED;
+	}
+
+	if (OverlayCount == 0) {
+		OverlayFirst = Lba;
+		OverlayLast = End - 1;
+	}
+	if (Lba < OverlayFirst)
+		OverlayFirst = Lba;
+	if (End - 1 > OverlayLast)
+		OverlayLast = End - 1;
+	for (; Lba < End; Lba++, Buffer += BlockSize) {
+		i = FindBlock(Lba);
+		if (i >= OverlayCount)
+			OverlayLba[OverlayCount++] = Lba;
+		CopyMem(&OverlayData[i * BlockSize], Buffer, BlockSize);
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI FilteredReadBlocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, UINTN BufferSize, VOID* Buffer)
+{
+	EFI_STATUS Status;
+
+	Status = OrgReadBlocks(This, MediaId, Lba, BufferSize, Buffer);
+	if (Status == EFI_SUCCESS)
+		ApplyOverlay(Lba, BufferSize, (UINT8*)Buffer);
+	return Status;
+}
+
+static EFI_STATUS EFIAPI FilteredWriteBlocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, UINTN BufferSize, VOID* Buffer)
+{
+	return WriteToOverlay(MediaId, Lba, BufferSize, (CONST UINT8*)Buffer);
+}
+
+/*
+ * Asynchronous BlockIo2 reads are left alone, unless they cover blocks
+ * from the overlay, in which case they are turned into synchronous ones.
+ */
+static EFI_STATUS EFIAPI FilteredReadBlocksEx(EFI_BLOCK_IO2_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer)
+{
+	EFI_STATUS Status;
+
+	if (!IsOverlaid(Lba, BufferSize))
+		return OrgReadBlocksEx(This, MediaId, Lba, Token, BufferSize, Buffer);
+	Status = FilteredReadBlocks(BlockIo, MediaId, Lba, BufferSize, Buffer);
+	if (EFI_ERROR(Status))
+		return Status;
+	if ((Token != NULL) && (Token->Event != NULL)) {
+		Token->TransactionStatus = EFI_SUCCESS;
+		gBS->SignalEvent(Token->Event);
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI FilteredWriteBlocksEx(EFI_BLOCK_IO2_PROTOCOL* This, UINT32 MediaId,
+	EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer)
+{
+	EFI_STATUS Status;
+
+	Status = WriteToOverlay(MediaId, Lba, BufferSize, (CONST UINT8*)Buffer);
+	if (EFI_ERROR(Status))
+		return Status;
+	if ((Token != NULL) && (Token->Event != NULL)) {
+		Token->TransactionStatus = EFI_SUCCESS;
+		gBS->SignalEvent(Token->Event);
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Present the target partition as read-only. This must be done before the
+ * file system driver binds to it, as this is when the driver decides
+ * whether it mounts the volume read-only.
+ */
+EFI_STATUS StartReadOnlyFilter(CONST EFI_HANDLE TargetHandle)
+{
+	EFI_STATUS Status;
+
+	if (BlockIo != NULL)
+		return EFI_ALREADY_STARTED;
+
+	Status = gBS->HandleProtocol(TargetHandle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo);
+	if (EFI_ERROR(Status)) {
+		BlockIo = NULL;
+		return Status;
+	}
+	if (gBS->HandleProtocol(TargetHandle, &gEfiBlockIo2ProtocolGuid, (VOID**)&BlockIo2) != EFI_SUCCESS)
+		BlockIo2 = NULL;
+
+	OverlayCount = 0;
+	Writes = Rejected = 0;
+	WriteSize = 0;
+	Locked = FALSE;
+	OrgReadOnly = BlockIo->Media->ReadOnly;
+	BlockIo->Media->ReadOnly = TRUE;
+	OrgReadBlocks = BlockIo->ReadBlocks;
+	OrgWriteBlocks = BlockIo->WriteBlocks;
+	BlockIo->ReadBlocks = FilteredReadBlocks;
+	BlockIo->WriteBlocks = FilteredWriteBlocks;
+	if (BlockIo2 != NULL) {
+		// BlockIo2 usually shares the media of BlockIo, but we can't be sure of that
+		BlockIo2->Media->ReadOnly = TRUE;
+		OrgReadBlocksEx = BlockIo2->ReadBlocksEx;
+		OrgWriteBlocksEx = BlockIo2->WriteBlocksEx;
+		BlockIo2->ReadBlocksEx = FilteredReadBlocksEx;
+		BlockIo2->WriteBlocksEx = FilteredWriteBlocksEx;
+	}
+	PrintDebug(L"  Target partition is presented as read-only");
+	return EFI_SUCCESS;
+}
+
+/* Report the writes the file system driver attempted */
+VOID ReportReadOnlyFilter(VOID)
+{
+	if ((BlockIo == NULL) || (Writes == 0))
+		return;
+	PrintWarning(L"  Driver attempted %d write(s) (%ld KB) to the read-only volume", Writes, DIV_U64(WriteSize, 1024));
+	if (Rejected != 0)
+		PrintWarning(L"  %d write(s) were rejected, as the %d KB overlay was full", Rejected, OVERLAY_SIZE / 1024);
+}
+
+/*
+ * Reject any further write, once the file system driver has mounted the volume.
+ * What the driver wrote so far stays in the overlay, so that its view of the
+ * volume doesn't change under it.
+ */
+VOID LockReadOnlyFilter(VOID)
+{
+	if (BlockIo != NULL)
+		Locked = TRUE;
+}
+
+/* Get the number of writes we absorbed and rejected, for telemetry */
+VOID GetReadOnlyFilterStats(UINT32* WriteCount, UINT32* RejectedCount)
+{
+	*WriteCount = Writes;
+	*RejectedCount = Rejected;
+}
+
+/* Remove our filter, which must be done before we exit */
+VOID StopReadOnlyFilter(VOID)
+{
+	if (BlockIo != NULL) {
+		BlockIo->Media->ReadOnly = OrgReadOnly;
+		BlockIo->ReadBlocks = OrgReadBlocks;
+		BlockIo->WriteBlocks = OrgWriteBlocks;
+		BlockIo = NULL;
+	}
+	if (BlockIo2 != NULL) {
+		BlockIo2->Media->ReadOnly = OrgReadOnly;
+		BlockIo2->ReadBlocksEx = OrgReadBlocksEx;
+		BlockIo2->WriteBlocksEx = OrgWriteBlocksEx;
+		BlockIo2 = NULL;
+	}
+	if (OverlayData != NULL) {
+		SafeFree(OverlayLba);
+		SafeFree(OverlayData);
+	}
+	OverlayCount = OverlayMax = 0;
+	Locked = FALSE;
+}
+#endif
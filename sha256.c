@@ -0,0 +1,112 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - SHA-256
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_PREFLIGHT
+/*
+ * A straightforward implementation of FIPS 180-4 SHA-256, as neither
+ * gnu-efi nor the base EDK2 libraries we link with provide one.
+ */
+
+static CONST UINT32 K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)           (((x) >> (n)) | ((x) << (32 - (n))))
+
+static VOID Sha256Transform(SHA256_CONTEXT* Context, CONST UINT8* Block)
+{
+	UINT32 W[64], a, b, c, d, e, f, g, h, t1, t2;
+	UINTN i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = ((UINT32)Block[4 * i] << 24) | ((UINT32)Block[4 * i + 1] << 16) |
+			((UINT32)Block[4 * i + 2] << 8) | (UINT32)Block[4 * i + 3];
+	for (; i < 64; i++)
+		W[i] = (ROR(W[i - 2], 17) ^ ROR(W[i - 2], 19) ^ (W[i - 2] >> 10)) + W[i - 7] +
+			(ROR(W[i - 15], 7) ^ ROR(W[i - 15], 18) ^ (W[i - 15] >> 3)) + W[i - 16];
+
+	a = Context->State[0]; b = Context->State[1]; c = Context->State[2]; d = Context->State[3];
+	e = Context->State[4]; f = Context->State[5]; g = Context->State[6]; h = Context->State[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + W[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	Context->State[0] += a; Context->State[1] += b; Context->State[2] += c; Context->State[3] += d;
+	Context->State[4] += e; Context->State[5] += f; Context->State[6] += g; Context->State[7] += h;
+}
+
+VOID Sha256Init(SHA256_CONTEXT* Context)
+{
+	Context->State[0] = 0x6a09e667; Context->State[1] = 0xbb67ae85;
+	Context->State[2] = 0x3c6ef372; Context->State[3] = 0xa54ff53a;
+	Context->State[4] = 0x510e527f; Context->State[5] = 0x9b05688c;
+	Context->State[6] = 0x1f83d9ab; Context->State[7] = 0x5be0cd19;
+	Context->Length = 0;
+}
+
+VOID Sha256Update(SHA256_CONTEXT* Context, CONST VOID* Data, UINTN Size)
+{
+	CONST UINT8* p = (CONST UINT8*)Data;
+	UINTN Used = (UINTN)(Context->Length & 0x3F), Chunk;
+
+	Context->Length += Size;
+	if (Used != 0) {
+		Chunk = (Size < 64 - Used) ? Size : 64 - Used;
+		CopyMem(&Context->Buffer[Used], p, Chunk);
+		p += Chunk;
+		Size -= Chunk;
+		if (Used + Chunk < 64)
+			return;
+		Sha256Transform(Context, Context->Buffer);
+	}
+	for (; Size >= 64; p += 64, Size -= 64)
+		Sha256Transform(Context, p);
+	if (Size != 0)
+		CopyMem(Context->Buffer, p, Size);
+}
+
+VOID Sha256Final(SHA256_CONTEXT* Context, UINT8* Digest)
+{
+	UINT64 Bits = LShiftU64(Context->Length, 3);
+	UINTN i, Used = (UINTN)(Context->Length & 0x3F);
+
+	Context->Buffer[Used++] = 0x80;
+	if (Used > 56) {
+		ZeroMem(&Context->Buffer[Used], 64 - Used);
+		Sha256Transform(Context, Context->Buffer);
+		Used = 0;
+	}
+	ZeroMem(&Context->Buffer[Used], 56 - Used);
+	for (i = 0; i < 8; i++)
+		Context->Buffer[63 - i] = (UINT8)RShiftU64(Bits, 8 * i);
+	Sha256Transform(Context, Context->Buffer);
+	for (i = 0; i < 32; i++)
+		Digest[i] = (UINT8)(Context->State[i / 4] >> (24 - 8 * (i % 4)));
+}
+#endif
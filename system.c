@@ -19,6 +19,11 @@
 
 #include "boot.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if FEATURE_SYSTEM_INFO || FEATURE_PROFILES
 /*
  * Read a system configuration table from a TableGuid.
  */
@@ -74,31 +79,44 @@ static CHAR8* GetSmbiosString(SMBIOS_STRUCTURE_POINTER* Smbios, UINT16 StringNum
 }
 
 /*
- * Query SMBIOS to display some info about the system hardware and UEFI firmware.
+ * Locate the SMBIOS structures, preferring the SMBIOS 3.x table if present.
  */
-EFI_STATUS PrintSystemInfo(VOID)
+static EFI_STATUS GetSmbiosStructures(SMBIOS_STRUCTURE_POINTER* Smbios, UINTN* MaximumSize)
 {
 	EFI_STATUS Status;
-	SMBIOS_STRUCTURE_POINTER Smbios;
 	SMBIOS_TABLE_ENTRY_POINT* SmbiosTable;
 	SMBIOS_TABLE_3_0_ENTRY_POINT* Smbios3Table;
-	UINT8 Found = 0, *Raw;
-	UINTN MaximumSize, ProcessedSize = 0;
-
-	PrintInfo(L"UEFI v%d.%d (%s, 0x%08X)", gST->Hdr.Revision >> 16, gST->Hdr.Revision & 0xFFFF,
-		gST->FirmwareVendor, gST->FirmwareRevision);
 
 	Status = GetSystemConfigurationTable(&gEfiSmbios3TableGuid, (VOID**)&Smbios3Table);
 	if (Status == EFI_SUCCESS) {
-		Smbios.Hdr = (SMBIOS_STRUCTURE*)(UINTN)Smbios3Table->TableAddress;
-		MaximumSize = (UINTN)Smbios3Table->TableMaximumSize;
+		Smbios->Hdr = (SMBIOS_STRUCTURE*)(UINTN)Smbios3Table->TableAddress;
+		*MaximumSize = (UINTN)Smbios3Table->TableMaximumSize;
 	} else {
 		Status = GetSystemConfigurationTable(&gEfiSmbiosTableGuid, (VOID**)&SmbiosTable);
 		if (EFI_ERROR(Status))
 			return EFI_NOT_FOUND;
-		Smbios.Hdr = (SMBIOS_STRUCTURE*)(UINTN)SmbiosTable->TableAddress;
-		MaximumSize = (UINTN)SmbiosTable->TableLength;
+		Smbios->Hdr = (SMBIOS_STRUCTURE*)(UINTN)SmbiosTable->TableAddress;
+		*MaximumSize = (UINTN)SmbiosTable->TableLength;
 	}
+	return EFI_SUCCESS;
+}
+#endif
+
+#if FEATURE_SYSTEM_INFO
+/*
+ * Query SMBIOS to display some info about the system hardware and UEFI firmware.
+ */
+EFI_STATUS PrintSystemInfo(VOID)
+{
+	SMBIOS_STRUCTURE_POINTER Smbios;
+	UINT8 Found = 0, *Raw;
+	UINTN MaximumSize, ProcessedSize = 0;
+
+	PrintInfo(L"UEFI v%d.%d (%s, 0x%08X)", gST->Hdr.Revision >> 16, gST->Hdr.Revision & 0xFFFF,
+		gST->FirmwareVendor, gST->FirmwareRevision);
+
+	if (GetSmbiosStructures(&Smbios, &MaximumSize) != EFI_SUCCESS)
+		return EFI_NOT_FOUND;
 	// Sanity check
 	if (MaximumSize > 1024 * 1024) {
 		PrintWarning(L"Aborting system report due to unexpected SMBIOS table length (0x%08X)", MaximumSize);
@@ -127,9 +145,10 @@ EFI_STATUS PrintSystemInfo(VOID)
 
 	return EFI_SUCCESS;
 }
+#endif
 
 /*
- * Query the Secure Boot related firmware variables.
+ * Query the Secure Boot related firmware variables, from our snapshot.
  * Returns:
  *  >0 if Secure Boot is enabled
  *   0 if Secure Boot is disabled
@@ -137,24 +156,339 @@ EFI_STATUS PrintSystemInfo(VOID)
  */
 INTN GetSecureBootStatus(VOID)
 {
-	UINT8 SecureBoot = 0, SetupMode = 0;
-	UINTN Size;
+	CONST PLATFORM_STATE* State = GetPlatformState();
 	/* Tri-state status for Secure Boot: -1 = Setup, 0 = Disabled, 1 = Enabled */
 	INTN SecureBootStatus = 0;
 
-	// Check if the SecureBoot variable exists
-	Size = sizeof(SecureBoot);
-	if (gRT->GetVariable(L"SecureBoot", &gEfiGlobalVariableGuid, NULL, &Size, &SecureBoot) == EFI_SUCCESS) {
-		// The "SecureBoot" variable indicates whether the platform firmware
-		// is operating in Secure Boot mode (1) or not (0).
-		SecureBootStatus = (INTN)SecureBoot;
-
-		// The "SetupMode" variable indicates whether the platform firmware
-		// is operating in Secure Boot Setup Mode (1) or not (0).
-		Size = sizeof(SetupMode);
-		if ((gRT->GetVariable(L"SetupMode", &gEfiGlobalVariableGuid, NULL, &Size, &SetupMode) == EFI_SUCCESS) && (SetupMode != 0))
+	if (State->HasSecureBoot) {
+		SecureBootStatus = (INTN)State->SecureBoot;
+		if (State->SetupMode != 0)
 			SecureBootStatus = -1;
 	}
 
 	return SecureBootStatus;
 }
+
+#if FEATURE_PROFILES
+/*
+ * Compute a key that identifies this platform, from the SMBIOS system UUID
+ * and product name as well as the firmware vendor and revision.
+ */
+UINT64 GetPlatformKey(VOID)
+{
+	SMBIOS_STRUCTURE_POINTER Smbios;
+	UINT64 Key = FNV1A64_INIT;
+	UINT8* Raw;
+	CHAR8* Product;
+	UINTN Len, MaximumSize, ProcessedSize = 0;
+
+	if (gST->FirmwareVendor != NULL)
+		Key = Fnv1a64(Key, gST->FirmwareVendor, StrLen(gST->FirmwareVendor) * sizeof(CHAR16));
+	Key = Fnv1a64(Key, &gST->FirmwareRevision, sizeof(gST->FirmwareRevision));
+
+	if ((GetSmbiosStructures(&Smbios, &MaximumSize) != EFI_SUCCESS) || (MaximumSize > 1024 * 1024))
+		return Key;
+
+	while (Smbios.Hdr->Type != 0x7F) {
+		Raw = Smbios.Raw;
+		if (Smbios.Hdr->Type == 1) {
+			// The UUID was only added with SMBIOS 2.1
+			if (Smbios.Hdr->Length >= 0x19)
+				Key = Fnv1a64(Key, &Smbios.Type1->Uuid, sizeof(Smbios.Type1->Uuid));
+			Product = GetSmbiosString(&Smbios, Smbios.Type1->ProductName);
+			if (Product != NULL) {
+				for (Len = 0; (Len < STRING_MAX) && (Product[Len] != 0); Len++);
+				Key = Fnv1a64(Key, Product, Len);
+			}
+			break;
+		}
+		GetSmbiosString(&Smbios, 0xFFFF);
+		ProcessedSize += (UINTN)Smbios.Raw - (UINTN)Raw;
+		if (ProcessedSize > MaximumSize)
+			break;
+	}
+
+	return Key;
+}
+#endif
+
+/*
+ * Minimal definition of EFI_TIMESTAMP_PROTOCOL, which is not provided by
+ * all the environments we build with.
+ */
+typedef struct {
+	UINT64 Frequency;
+	UINT64 EndValue;
+} TIMESTAMP_PROPERTIES;
+
+typedef struct {
+	UINT64 (EFIAPI *GetTimestamp)(VOID);
+	EFI_STATUS (EFIAPI *GetProperties)(TIMESTAMP_PROPERTIES* Properties);
+} TIMESTAMP_PROTOCOL;
+
+static EFI_GUID TimestampProtocolGuid =
+	{ 0xafbfde41, 0x2e6e, 0x4262, { 0xba, 0x65, 0x62, 0xb9, 0x23, 0x6e, 0x54, 0x95 } };
+
+static TIMESTAMP_PROTOCOL* Timestamp = NULL;
+static UINT64 TicksPerMs = 0, TimestampEnd = 0, StartTime = 0;
+static UINT64 PhaseStart[PHASE_MAX] = { 0 };
+static UINT32 PhaseTime[PHASE_MAX] = { 0 };
+
+/* How long we stall to calibrate the CPU counter, in microseconds */
+#define CALIBRATION_TIME        1000
+
+/*
+ * Read the free running counter of the CPU, for platforms that don't provide
+ * the Timestamp protocol. Returns 0 if we don't know how to read it.
+ */
+static __inline UINT64 ReadCpuCounter(VOID)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	return __rdtsc();
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+	return (UINT64)_ReadStatusReg(ARM64_CNTVCT);
+#elif defined(__x86_64__) || defined(__i386__)
+	UINT32 Lo, Hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (Lo), "=d" (Hi));
+	return LShiftU64(Hi, 32) | Lo;
+#elif defined(__aarch64__)
+	UINT64 Value;
+	__asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r" (Value));
+	return Value;
+#elif defined(__riscv) && (__riscv_xlen == 64)
+	UINT64 Value;
+	__asm__ __volatile__ ("rdtime %0" : "=r" (Value));
+	return Value;
+#elif defined(__loongarch64)
+	UINT64 Value;
+	__asm__ __volatile__ ("rdtime.d %0, $zero" : "=r" (Value));
+	return Value;
+#else
+	// 32-bit ARM may not have a generic timer, and reading it would fault
+	return 0;
+#endif
+}
+
+/* Time of day in milliseconds, for platforms that don't have any counter we can use */
+static UINT64 GetTimeOfDay(VOID)
+{
+	EFI_TIME Time;
+
+	if (gRT->GetTime(&Time, NULL) != EFI_SUCCESS)
+		return 0;
+	return (((UINT64)Time.Hour * 60 + Time.Minute) * 60 + Time.Second) * 1000 + Time.Nanosecond / 1000000;
+}
+
+/*
+ * Set the reference point for GetElapsedTime(). This uses the Timestamp
+ * protocol when available. Otherwise, we calibrate the counter of the CPU
+ * against Stall(), as the RTC, which we fall back to when this fails, only
+ * has a resolution of one second on many platforms and is slow to read.
+ */
+VOID InitTimer(VOID)
+{
+	TIMESTAMP_PROPERTIES Properties;
+	UINT64 Start;
+
+	if ((gBS->LocateProtocol(&TimestampProtocolGuid, NULL, (VOID**)&Timestamp) == EFI_SUCCESS) &&
+		(Timestamp->GetProperties(&Properties) == EFI_SUCCESS) && (Properties.Frequency >= 1000)) {
+		TicksPerMs = DIV_U64(Properties.Frequency, 1000);
+		TimestampEnd = Properties.EndValue;
+		StartTime = Timestamp->GetTimestamp();
+		return;
+	}
+
+	Timestamp = NULL;
+	Start = ReadCpuCounter();
+	if (Start != 0) {
+		gBS->Stall(CALIBRATION_TIME);
+		TicksPerMs = DIV_U64(ReadCpuCounter() - Start, CALIBRATION_TIME / 1000);
+		// The counters we read are 64-bit, so they never wrap in practice
+		TimestampEnd = (UINT64)-1;
+		StartTime = Start;
+	}
+	if (TicksPerMs == 0)
+		StartTime = GetTimeOfDay();
+}
+
+/* Whether we have a time source with (at least) millisecond resolution */
+BOOLEAN IsTimerPrecise(VOID)
+{
+	return (TicksPerMs != 0);
+}
+
+/* Number of counter ticks since InitTimer() was called */
+static UINT64 GetElapsedTicks(VOID)
+{
+	UINT64 Now = (Timestamp != NULL) ? Timestamp->GetTimestamp() : ReadCpuCounter();
+
+	if (Now < StartTime)
+		return (TimestampEnd - StartTime) + Now + 1;
+	return Now - StartTime;
+}
+
+/*
+ * Return the number of milliseconds elapsed since InitTimer() was called.
+ */
+UINT64 GetElapsedTime(VOID)
+{
+	UINT64 Now;
+
+	if (TicksPerMs == 0) {
+		Now = GetTimeOfDay();
+		// Midnight rollover
+		if (Now < StartTime)
+			Now += 24 * 60 * 60 * 1000ULL;
+		return Now - StartTime;
+	}
+
+	// TicksPerMs is always 32-bit for the frequencies we may encounter
+	return DIV_U64(GetElapsedTicks(), (UINT32)TicksPerMs);
+}
+
+/*
+ * Same as GetElapsedTime(), in microseconds, for the timing of single I/O
+ * requests. Without a counter, this only has the precision of the RTC.
+ */
+UINT64 GetElapsedTimeUs(VOID)
+{
+	if (TicksPerMs == 0)
+		return MultU64x32(GetElapsedTime(), 1000);
+	return DIV_U64(MultU64x32(GetElapsedTicks(), 1000), (UINT32)TicksPerMs);
+}
+
+/*
+ * Boot phase timing. Phases that are entered multiple times accumulate.
+ */
+VOID StartPhase(CONST BOOT_PHASE Phase)
+{
+	V_ASSERT(Phase < PHASE_MAX);
+	PhaseStart[Phase] = GetElapsedTime();
+}
+
+VOID EndPhase(CONST BOOT_PHASE Phase)
+{
+	V_ASSERT(Phase < PHASE_MAX);
+	PhaseTime[Phase] += (UINT32)(GetElapsedTime() - PhaseStart[Phase]);
+}
+
+UINT32 GetPhaseTime(CONST BOOT_PHASE Phase)
+{
+	V_ASSERT(Phase < PHASE_MAX);
+	return PhaseTime[Phase];
+}
+
+/*
+ * Memory usage, in pages, as reported by the memory map
+ */
+typedef struct {
+	UINT64  BsCode;
+	UINT64  BsData;
+	UINT64  LoaderData;
+	UINT64  Free;
+	UINT64  LargestFree;
+} MEMORY_USAGE;
+
+static MEMORY_USAGE LastUsage;
+static BOOLEAN HasLastUsage = FALSE;
+
+#define PAGES_TO_KB(n)      ((INT64)(n) * (EFI_PAGE_SIZE / 1024))
+
+/* Snapshot the memory map and tally the pages of the types we are interested in */
+static EFI_STATUS GetMemoryUsage(MEMORY_USAGE* Usage)
+{
+	EFI_STATUS Status;
+	EFI_MEMORY_DESCRIPTOR *MemoryMap = NULL, *Desc;
+	UINTN MapSize = 0, MapKey, DescSize, i;
+	UINT32 DescVersion;
+
+	Status = gBS->GetMemoryMap(&MapSize, MemoryMap, &MapKey, &DescSize, &DescVersion);
+	while (Status == EFI_BUFFER_TOO_SMALL) {
+		// Allocating the map may split a descriptor, so leave some headroom
+		MapSize += 4 * DescSize;
+		MemoryMap = AllocatePool(MapSize);
+		if (MemoryMap == NULL)
+			return EFI_OUT_OF_RESOURCES;
+		Status = gBS->GetMemoryMap(&MapSize, MemoryMap, &MapKey, &DescSize, &DescVersion);
+		if (Status == EFI_BUFFER_TOO_SMALL)
+			SafeFree(MemoryMap);
+	}
+	if (EFI_ERROR(Status))
+		goto out;
+
+	ZeroMem(Usage, sizeof(MEMORY_USAGE));
+	for (i = 0; i + DescSize <= MapSize; i += DescSize) {
+		Desc = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)MemoryMap + i);
+		switch (Desc->Type) {
+		case EfiBootServicesCode:
+			Usage->BsCode += Desc->NumberOfPages;
+			break;
+		case EfiBootServicesData:
+			Usage->BsData += Desc->NumberOfPages;
+			break;
+		case EfiLoaderData:
+			Usage->LoaderData += Desc->NumberOfPages;
+			break;
+		case EfiConventionalMemory:
+			Usage->Free += Desc->NumberOfPages;
+			if (Desc->NumberOfPages > Usage->LargestFree)
+				Usage->LargestFree = Desc->NumberOfPages;
+			break;
+		default:
+			break;
+		}
+	}
+
+out:
+	if (MemoryMap != NULL)
+		FreePool(MemoryMap);
+	return Status;
+}
+
+/*
+ * Snapshot the memory map and report memory usage, along with the changes
+ * since the previous snapshot. This is meant to find out how much memory the
+ * file system driver and ourselves hold when we hand over to the loader.
+ */
+VOID ReportMemoryUsage(CONST CHAR16* Label)
+{
+	EFI_STATUS Status;
+	MEMORY_USAGE Usage;
+
+	// Don't bother with the memory map if we can't report it
+	if (LOG_DEBUG > LOG_MAX_LEVEL)
+		return;
+
+	Status = GetMemoryUsage(&Usage);
+	if (EFI_ERROR(Status)) {
+		PrintDebug(L"Could not read memory map: %r", Status);
+		return;
+	}
+
+	PrintDebug(L"Memory %s: BS code %ld KB, BS data %ld KB, loader data %ld KB, free %ld KB (largest %ld KB)",
+		Label, PAGES_TO_KB(Usage.BsCode), PAGES_TO_KB(Usage.BsData), PAGES_TO_KB(Usage.LoaderData),
+		PAGES_TO_KB(Usage.Free), PAGES_TO_KB(Usage.LargestFree));
+	if (HasLastUsage)
+		PrintDebug(L"  Change: BS code %ld KB, BS data %ld KB, loader data %ld KB, free %ld KB",
+			PAGES_TO_KB(Usage.BsCode) - PAGES_TO_KB(LastUsage.BsCode),
+			PAGES_TO_KB(Usage.BsData) - PAGES_TO_KB(LastUsage.BsData),
+			PAGES_TO_KB(Usage.LoaderData) - PAGES_TO_KB(LastUsage.LoaderData),
+			PAGES_TO_KB(Usage.Free) - PAGES_TO_KB(LastUsage.Free));
+	CopyMem(&LastUsage, &Usage, sizeof(Usage));
+	HasLastUsage = TRUE;
+}
+
+/*
+ * Return the number of free pages, and the size of the largest free region
+ * in pages, so that we can size our buffers without starving the loader.
+ */
+UINT64 GetFreeMemory(UINT64* LargestFree)
+{
+	MEMORY_USAGE Usage;
+
+	if (GetMemoryUsage(&Usage) != EFI_SUCCESS)
+		Usage.Free = Usage.LargestFree = 0;
+	if (LargestFree != NULL)
+		*LargestFree = Usage.LargestFree;
+	return Usage.Free;
+}
@@ -0,0 +1,152 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Boot telemetry
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+#include "version.h"
+
+#if FEATURE_TELEMETRY
+/*
+ * Right before we start the bootloader, we publish how the boot went, so that
+ * the OS, or its installer, can find out without parsing our log. This is done
+ * as a configuration table, for anything that runs before ExitBootServices(),
+ * and as a volatile variable, for the OS (through efivarfs on Linux, or
+ * GetFirmwareEnvironmentVariable() on Windows). Since the variable is not
+ * non-volatile, this never results in a flash write. The format below must be
+ * kept in sync with tools/decode-telemetry.c.
+ */
+#define TELEMETRY_VARIABLE      L"UefiNtfsTelemetry"
+#define TELEMETRY_MAGIC         0x4D544E55	/* "UNTM" */
+#define TELEMETRY_VERSION       1
+#define TELEMETRY_PHASES        8
+
+#pragma pack(push, 1)
+typedef struct {
+	UINT32  Magic;
+	UINT16  Version;
+	UINT16  Size;
+	UINT32  Launches;		/* Number of times a bootloader was started */
+	INT32   SecureBoot;		/* 1 = Enabled, 0 = Disabled, -1 = Setup Mode */
+	UINT32  ProfileFlags;		/* PROFILE_ flags of this platform */
+	UINT32  TotalTime;		/* In ms, from our start to the bootloader's */
+	UINT32  PhaseCount;
+	UINT32  PhaseTime[TELEMETRY_PHASES];
+	UINT32  TransferSize;		/* Read size used for the boot disk, in bytes */
+	UINT32  MetadataHits;
+	UINT32  MetadataMisses;
+	UINT32  MetadataBypassed;	/* Reads that were too large for the metadata cache */
+	UINT32  ReadAheadExtents;
+	UINT64  ReadAheadSize;		/* In bytes */
+	UINT32  OverlayWrites;		/* Writes kept in RAM by the read-only filter */
+	UINT32  OverlayRejected;
+	CHAR16  AppVersion[16];
+	CHAR16  Transport[16];
+	CHAR16  FileSystem[8];
+	CHAR16  Driver[64];		/* Empty if the firmware's own driver was used */
+	CHAR16  Loader[64];
+} TELEMETRY;
+#pragma pack(pop)
+
+/* {6C9A8F4E-3B1D-4E7A-9C52-1F8D3E6A27B4} */
+static EFI_GUID TelemetryGuid = { 0x6c9a8f4e, 0x3b1d, 0x4e7a, { 0x9c, 0x52, 0x1f, 0x8d, 0x3e, 0x6a, 0x27, 0xb4 } };
+
+static TELEMETRY* Telemetry = NULL;
+static CHAR16 FileSystemName[8], DriverName[64];
+
+/* Copy a string into one of our fixed size fields, truncating it if needed */
+static VOID CopyString(CHAR16* Destination, CONST UINTN DestMax, CONST CHAR16* Source)
+{
+	UINTN i;
+
+	for (i = 0; (Source != NULL) && (Source[i] != L'\0') && (i < DestMax - 1); i++)
+		Destination[i] = Source[i];
+	Destination[i] = L'\0';
+}
+
+/*
+ * Record the file system of the target and the name of the driver we started
+ * for it. Driver is NULL when the firmware already services the partition.
+ */
+VOID SetTelemetryTarget(CONST CHAR16* FileSystem, CONST CHAR16* Driver)
+{
+	CopyString(FileSystemName, ARRAY_SIZE(FileSystemName), FileSystem);
+	CopyString(DriverName, ARRAY_SIZE(DriverName), Driver);
+}
+
+/*
+ * Publish what we know about this boot. This is called when we first start a
+ * bootloader, as relaunching it doesn't make for a new boot.
+ */
+EFI_STATUS PublishTelemetry(CONST CHAR16* Loader, CONST INTN SecureBootStatus, CONST UINT32 ProfileFlags,
+	CONST IO_PROFILE* IoProfile)
+{
+	EFI_STATUS Status;
+	UINTN Phase;
+
+	if ((Loader == NULL) || (IoProfile == NULL))
+		return EFI_INVALID_PARAMETER;
+
+	// The table must still be there once the OS has taken over
+	if (Telemetry == NULL) {
+		Status = gBS->AllocatePool(EfiRuntimeServicesData, sizeof(TELEMETRY), (VOID**)&Telemetry);
+		if (EFI_ERROR(Status)) {
+			Telemetry = NULL;
+			return Status;
+		}
+		ZeroMem(Telemetry, sizeof(TELEMETRY));
+		Telemetry->Magic = TELEMETRY_MAGIC;
+		Telemetry->Version = TELEMETRY_VERSION;
+		Telemetry->Size = sizeof(TELEMETRY);
+	}
+
+	Telemetry->Launches++;
+	Telemetry->SecureBoot = (INT32)SecureBootStatus;
+	Telemetry->ProfileFlags = ProfileFlags;
+	Telemetry->TotalTime = (UINT32)GetElapsedTime();
+	Telemetry->PhaseCount = (PHASE_MAX < TELEMETRY_PHASES) ? PHASE_MAX : TELEMETRY_PHASES;
+	for (Phase = 0; Phase < Telemetry->PhaseCount; Phase++)
+		Telemetry->PhaseTime[Phase] = GetPhaseTime((BOOT_PHASE)Phase);
+	Telemetry->TransferSize = IoProfile->TransferSize;
+#if FEATURE_METADATA_CACHE
+	GetMetadataCacheStats(&Telemetry->MetadataHits, &Telemetry->MetadataMisses, &Telemetry->MetadataBypassed);
+#endif
+#if FEATURE_READAHEAD
+	Telemetry->ReadAheadSize = GetReadAheadStats(&Telemetry->ReadAheadExtents);
+#endif
+#if FEATURE_READONLY
+	GetReadOnlyFilterStats(&Telemetry->OverlayWrites, &Telemetry->OverlayRejected);
+#endif
+	CopyString(Telemetry->AppVersion, ARRAY_SIZE(Telemetry->AppVersion), VERSION_STRING);
+	CopyString(Telemetry->Transport, ARRAY_SIZE(Telemetry->Transport), GetTransportName(IoProfile->Transport));
+	CopyString(Telemetry->FileSystem, ARRAY_SIZE(Telemetry->FileSystem), FileSystemName);
+	CopyString(Telemetry->Driver, ARRAY_SIZE(Telemetry->Driver), DriverName);
+	// Skip the leading backslash, as we do when we display the path
+	CopyString(Telemetry->Loader, ARRAY_SIZE(Telemetry->Loader), (Loader[0] == L'\\') ? &Loader[1] : Loader);
+
+	Status = gBS->InstallConfigurationTable(&TelemetryGuid, Telemetry);
+	if (EFI_ERROR(Status))
+		PrintDebug(L"Could not install telemetry table: %r", Status);
+	// NB: No EFI_VARIABLE_NON_VOLATILE, so that this never gets written to flash
+	Status = gRT->SetVariable(TELEMETRY_VARIABLE, &TelemetryGuid,
+		EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS, sizeof(TELEMETRY), Telemetry);
+	if (EFI_ERROR(Status))
+		PrintDebug(L"Could not set telemetry variable: %r", Status);
+	else
+		PrintDebug(L"Published telemetry (%d bytes)", sizeof(TELEMETRY));
+	return Status;
+}
+#endif
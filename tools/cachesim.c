@@ -0,0 +1,647 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Disk trace cache simulator
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This host tool replays the disk traces recorded by a uefi-ntfs build with
+ * FEATURE_TRACE enabled (\efi\rufus\uefi-ntfs.trc) against various cache
+ * models and sizes, and reports the hit rate, the amount of data read from
+ * the device, and the boot time we could expect with each of them, on USB
+ * 2.0, USB 3.0 and NVMe devices. Build it with:
+ *
+ *   gcc -O2 -o cachesim tools/cachesim.c
+ *
+ * The predicted boot time is the time the trace covers, minus the time the
+ * recorded requests took, plus the time the simulated device requests would
+ * take. Writes always go to the device and invalidate the cached lines.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Must be kept in sync with trace.c */
+#define TRACE_MAGIC             0x43525442	/* "BTRC" */
+#define TRACE_VERSION           1
+#define TRACE_OP_WRITE          1
+
+#pragma pack(push, 1)
+typedef struct {
+	uint8_t  op;
+	uint8_t  reserved[3];
+	uint32_t size;
+	uint32_t time;
+	uint32_t duration;
+	uint64_t offset;
+} trace_entry_t;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count;
+	uint32_t dropped;
+	uint32_t block_size;
+	uint32_t reserved;
+	uint64_t media_size;
+} trace_header_t;
+#pragma pack(pop)
+
+#define ARRAYSIZE(a)            (sizeof(a) / sizeof((a)[0]))
+#define MAX_SIZES               16
+#define MAX_WINDOWS             8
+
+/* Per request latency (µs) and sustained bandwidth (MB/s) of the devices we model */
+typedef struct {
+	const char* name;
+	double latency;
+	double bandwidth;
+} device_t;
+
+static const device_t device[] = {
+	{ "USB 2.0", 1000.0, 35.0 },
+	{ "USB 3.0", 150.0, 350.0 },
+	{ "NVMe", 20.0, 2000.0 },
+};
+
+typedef enum {
+	MODEL_NONE = 0,
+	MODEL_LRU,
+	MODEL_ARC,
+	MODEL_SETASSOC,
+	MODEL_READAHEAD,
+	MODEL_EXTENT,
+} model_type_t;
+
+/* ARC lists. The LRU models only use the first one. */
+enum { T1 = 0, T2, B1, B2 };
+
+typedef struct {
+	uint64_t tag;
+	int32_t prev, next;		/* List links, towards the most/least recently used */
+	int32_t hnext;			/* Hash chain */
+	int32_t list;
+} node_t;
+
+typedef struct {
+	int32_t head, tail;		/* Most and least recently used */
+	size_t size;
+} list_t;
+
+typedef struct {
+	model_type_t type;
+	size_t lines;			/* Capacity, in lines (per set for set associative caches) */
+	size_t nlists;
+	list_t* list;
+	node_t* node;
+	int32_t free;
+	int32_t* bucket;
+	size_t nbuckets;
+	size_t p;			/* ARC target size for T1 */
+} cache_t;
+
+typedef struct {
+	uint64_t start, end;		/* In lines, end excluded */
+} extent_t;
+
+typedef struct {
+	uint64_t accesses, hits;
+	uint64_t requests, bytes;
+	double io_time[ARRAYSIZE(device)];
+} stats_t;
+
+static trace_header_t header;
+static trace_entry_t* entry;
+static extent_t* extent;
+static size_t extent_count;
+static uint32_t line_size = 4096;
+static uint32_t ways = 4;
+
+static size_t hash(const cache_t* c, uint64_t tag)
+{
+	return (size_t)((tag * 0x9E3779B97F4A7C15ULL) >> 17) % c->nbuckets;
+}
+
+static int32_t lookup(const cache_t* c, uint64_t tag)
+{
+	int32_t n;
+
+	for (n = c->bucket[hash(c, tag)]; (n >= 0) && (c->node[n].tag != tag); n = c->node[n].hnext);
+	return n;
+}
+
+static void list_remove(cache_t* c, int32_t n)
+{
+	list_t* l = &c->list[c->node[n].list];
+
+	if (c->node[n].prev >= 0)
+		c->node[c->node[n].prev].next = c->node[n].next;
+	else
+		l->head = c->node[n].next;
+	if (c->node[n].next >= 0)
+		c->node[c->node[n].next].prev = c->node[n].prev;
+	else
+		l->tail = c->node[n].prev;
+	l->size--;
+}
+
+static void list_push(cache_t* c, int32_t n, int32_t list)
+{
+	list_t* l = &c->list[list];
+
+	c->node[n].list = list;
+	c->node[n].prev = -1;
+	c->node[n].next = l->head;
+	if (l->head >= 0)
+		c->node[l->head].prev = n;
+	else
+		l->tail = n;
+	l->head = n;
+	l->size++;
+}
+
+static int32_t node_new(cache_t* c, uint64_t tag, int32_t list)
+{
+	int32_t n = c->free;
+	size_t h = hash(c, tag);
+
+	if (n < 0) {
+		fprintf(stderr, "Node pool exhausted\n");
+		exit(1);
+	}
+	c->free = c->node[n].hnext;
+	c->node[n].tag = tag;
+	c->node[n].hnext = c->bucket[h];
+	c->bucket[h] = n;
+	list_push(c, n, list);
+	return n;
+}
+
+static void node_delete(cache_t* c, int32_t n)
+{
+	int32_t* p;
+
+	list_remove(c, n);
+	for (p = &c->bucket[hash(c, c->node[n].tag)]; *p != n; p = &c->node[*p].hnext);
+	*p = c->node[n].hnext;
+	c->node[n].hnext = c->free;
+	c->free = n;
+}
+
+static void move_to(cache_t* c, int32_t n, int32_t list)
+{
+	list_remove(c, n);
+	list_push(c, n, list);
+}
+
+static cache_t* cache_new(model_type_t type, size_t size)
+{
+	cache_t* c = calloc(1, sizeof(cache_t));
+	size_t i, nodes;
+
+	c->type = type;
+	c->lines = size / line_size;
+	if (c->lines == 0)
+		c->lines = 1;
+	switch (type) {
+	case MODEL_ARC:
+		c->nlists = 4;
+		nodes = 2 * c->lines + 1;
+		break;
+	case MODEL_SETASSOC:
+		c->nlists = c->lines / ways;
+		if (c->nlists == 0)
+			c->nlists = 1;
+		c->lines = ways;
+		nodes = c->nlists * ways + 1;
+		break;
+	default:
+		c->nlists = 1;
+		nodes = c->lines + 1;
+		break;
+	}
+	c->list = malloc(c->nlists * sizeof(list_t));
+	for (i = 0; i < c->nlists; i++) {
+		c->list[i].head = c->list[i].tail = -1;
+		c->list[i].size = 0;
+	}
+	c->node = malloc(nodes * sizeof(node_t));
+	for (i = 0; i < nodes; i++)
+		c->node[i].hnext = (i + 1 < nodes) ? (int32_t)(i + 1) : -1;
+	c->free = 0;
+	c->nbuckets = nodes;
+	c->bucket = malloc(c->nbuckets * sizeof(int32_t));
+	for (i = 0; i < c->nbuckets; i++)
+		c->bucket[i] = -1;
+	return c;
+}
+
+static void cache_free(cache_t* c)
+{
+	free(c->list);
+	free(c->node);
+	free(c->bucket);
+	free(c);
+}
+
+/* ARC replacement, from "ARC: A Self-Tuning, Low Overhead Replacement Cache" */
+static void arc_replace(cache_t* c, int in_b2)
+{
+	if ((c->list[T1].size > 0) && ((c->list[T1].size > c->p) || (in_b2 && (c->list[T1].size == c->p))))
+		move_to(c, c->list[T1].tail, B1);
+	else if (c->list[T2].size > 0)
+		move_to(c, c->list[T2].tail, B2);
+}
+
+static int arc_access(cache_t* c, uint64_t tag)
+{
+	int32_t n = lookup(c, tag);
+	size_t delta, total;
+
+	if ((n >= 0) && ((c->node[n].list == T1) || (c->node[n].list == T2))) {
+		move_to(c, n, T2);
+		return 1;
+	}
+	if ((n >= 0) && (c->node[n].list == B1)) {
+		delta = (c->list[B2].size > c->list[B1].size) ? c->list[B2].size / c->list[B1].size : 1;
+		c->p = (c->p + delta > c->lines) ? c->lines : c->p + delta;
+		arc_replace(c, 0);
+		move_to(c, n, T2);
+		return 0;
+	}
+	if ((n >= 0) && (c->node[n].list == B2)) {
+		delta = (c->list[B1].size > c->list[B2].size) ? c->list[B1].size / c->list[B2].size : 1;
+		c->p = (delta > c->p) ? 0 : c->p - delta;
+		arc_replace(c, 1);
+		move_to(c, n, T2);
+		return 0;
+	}
+	total = c->list[T1].size + c->list[T2].size + c->list[B1].size + c->list[B2].size;
+	if (c->list[T1].size + c->list[B1].size == c->lines) {
+		if (c->list[T1].size < c->lines) {
+			node_delete(c, c->list[B1].tail);
+			arc_replace(c, 0);
+		} else {
+			node_delete(c, c->list[T1].tail);
+		}
+	} else if (total >= c->lines) {
+		if (total >= 2 * c->lines)
+			node_delete(c, c->list[B2].tail);
+		arc_replace(c, 0);
+	}
+	node_new(c, tag, T1);
+	return 0;
+}
+
+/* Access a line, adding it to the cache if needed. Returns 1 if the line was cached. */
+static int cache_access(cache_t* c, uint64_t tag)
+{
+	int32_t n, list;
+
+	if (c->type == MODEL_NONE)
+		return 0;
+	if (c->type == MODEL_ARC)
+		return arc_access(c, tag);
+	list = (c->type == MODEL_SETASSOC) ? (int32_t)(tag % c->nlists) : 0;
+	n = lookup(c, tag);
+	if (n >= 0) {
+		move_to(c, n, list);
+		return 1;
+	}
+	if (c->list[list].size >= c->lines)
+		node_delete(c, c->list[list].tail);
+	node_new(c, tag, list);
+	return 0;
+}
+
+static int cache_contains(const cache_t* c, uint64_t tag)
+{
+	int32_t n;
+
+	if (c->type == MODEL_NONE)
+		return 0;
+	n = lookup(c, tag);
+	return (n >= 0) && (c->node[n].list != B1) && (c->node[n].list != B2);
+}
+
+static void cache_invalidate(cache_t* c, uint64_t tag)
+{
+	int32_t n;
+
+	if (c->type == MODEL_NONE)
+		return;
+	n = lookup(c, tag);
+	if (n >= 0)
+		node_delete(c, n);
+}
+
+static void device_request(stats_t* s, uint64_t bytes)
+{
+	size_t d;
+
+	s->requests++;
+	s->bytes += bytes;
+	for (d = 0; d < ARRAYSIZE(device); d++)
+		s->io_time[d] += device[d].latency + (double)bytes / device[d].bandwidth;
+}
+
+/* Find the extent a line belongs to */
+static const extent_t* find_extent(uint64_t tag)
+{
+	size_t lo = 0, hi = extent_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tag < extent[mid].start)
+			hi = mid;
+		else if (tag >= extent[mid].end)
+			lo = mid + 1;
+		else
+			return &extent[mid];
+	}
+	return NULL;
+}
+
+/*
+ * Add lines that were not requested to the cache, reading the ones we don't
+ * have as a single request. Returns the number of lines that were read.
+ */
+static uint64_t prefetch(cache_t* c, uint64_t start, uint64_t end, stats_t* s, int merge)
+{
+	uint64_t tag, count = 0, max_tag = (header.media_size + line_size - 1) / line_size;
+
+	if (end > max_tag)
+		end = max_tag;
+	for (tag = start; tag < end; tag++) {
+		if (!cache_contains(c, tag)) {
+			cache_access(c, tag);
+			count++;
+		}
+	}
+	if (count == 0)
+		return 0;
+	if (merge) {
+		// Part of the request that was just issued => only the transfer time counts
+		size_t d;
+		s->bytes += count * line_size;
+		for (d = 0; d < ARRAYSIZE(device); d++)
+			s->io_time[d] += (double)(count * line_size) / device[d].bandwidth;
+	} else {
+		device_request(s, count * line_size);
+	}
+	return count;
+}
+
+static void simulate(model_type_t type, size_t size, uint64_t window, stats_t* s)
+{
+	cache_t* c = cache_new(type, size);
+	const extent_t* e;
+	uint64_t tag, first, last, run = 0, prev_end = UINT64_MAX, max_extent;
+	uint32_t i;
+	int missed, missed_last;
+
+	memset(s, 0, sizeof(*s));
+	// Never prefetch more than half of the cache in one go
+	max_extent = (c->type == MODEL_SETASSOC) ? 1 : ((size / line_size) / 2);
+	for (i = 0; i < header.count; i++) {
+		if (entry[i].size == 0)
+			continue;
+		first = entry[i].offset / line_size;
+		last = (entry[i].offset + entry[i].size - 1) / line_size;
+		if (entry[i].op == TRACE_OP_WRITE) {
+			for (tag = first; tag <= last; tag++)
+				cache_invalidate(c, tag);
+			device_request(s, entry[i].size);
+			continue;
+		}
+		if (type == MODEL_NONE) {
+			s->accesses += last - first + 1;
+			device_request(s, entry[i].size);
+			continue;
+		}
+		// Whole extent prefetch: read the extent of the first line we miss in one go
+		if ((type == MODEL_EXTENT) && !cache_contains(c, first)) {
+			e = find_extent(first);
+			if ((e != NULL) && (e->end - e->start <= max_extent))
+				prefetch(c, e->start, e->end, s, 0);
+		}
+		// Issue one device request per run of lines we miss
+		missed = missed_last = 0;
+		for (tag = first; tag <= last; tag++) {
+			s->accesses++;
+			if (cache_access(c, tag)) {
+				s->hits++;
+				if (run != 0)
+					device_request(s, run * line_size);
+				run = 0;
+				missed_last = 0;
+			} else {
+				run++;
+				missed = missed_last = 1;
+			}
+		}
+		if (run != 0)
+			device_request(s, run * line_size);
+		run = 0;
+		// Sequential read-ahead: extend reads that follow the previous one
+		if ((type == MODEL_READAHEAD) && (entry[i].offset == prev_end) && missed)
+			prefetch(c, last + 1, last + 1 + ((window / line_size < max_extent) ? window / line_size : max_extent),
+				s, missed_last);
+		prev_end = entry[i].offset + entry[i].size;
+	}
+	cache_free(c);
+}
+
+/* Merge the lines that are read in the trace into extents */
+static int compare_extents(const void* a, const void* b)
+{
+	const extent_t *x = a, *y = b;
+
+	return (x->start < y->start) ? -1 : (x->start > y->start);
+}
+
+static void build_extents(void)
+{
+	size_t i, j;
+
+	extent = malloc(header.count * sizeof(extent_t));
+	for (i = 0, j = 0; i < header.count; i++) {
+		if ((entry[i].op == TRACE_OP_WRITE) || (entry[i].size == 0))
+			continue;
+		extent[j].start = entry[i].offset / line_size;
+		extent[j].end = (entry[i].offset + entry[i].size - 1) / line_size + 1;
+		j++;
+	}
+	qsort(extent, j, sizeof(extent_t), compare_extents);
+	for (i = 0, extent_count = 0; i < j; i++) {
+		if ((extent_count > 0) && (extent[i].start <= extent[extent_count - 1].end)) {
+			if (extent[i].end > extent[extent_count - 1].end)
+				extent[extent_count - 1].end = extent[i].end;
+		} else {
+			extent[extent_count++] = extent[i];
+		}
+	}
+}
+
+static uint64_t parse_size(const char* str)
+{
+	char* end;
+	uint64_t size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G': size <<= 10;	/* Fall through */
+	case 'm': case 'M': size <<= 10;	/* Fall through */
+	case 'k': case 'K': size <<= 10;	break;
+	default: break;
+	}
+	return size;
+}
+
+static size_t parse_list(char* str, uint64_t* list, size_t max)
+{
+	size_t count = 0;
+	char* tok;
+
+	for (tok = strtok(str, ","); (tok != NULL) && (count < max); tok = strtok(NULL, ","))
+		list[count++] = parse_size(tok);
+	return count;
+}
+
+static void print_row(const char* model, uint64_t size, const stats_t* s, double base)
+{
+	char str[32];
+	size_t d;
+
+	if (size == 0)
+		snprintf(str, sizeof(str), "-");
+	else if (size >= 1024 * 1024)
+		snprintf(str, sizeof(str), "%lluM", (unsigned long long)(size >> 20));
+	else
+		snprintf(str, sizeof(str), "%lluK", (unsigned long long)(size >> 10));
+	printf("%-22s %6s %7.2f%% %8llu %9.2f", model, str,
+		(s->accesses == 0) ? 0.0 : 100.0 * s->hits / s->accesses,
+		(unsigned long long)s->requests, s->bytes / (1024.0 * 1024.0));
+	for (d = 0; d < ARRAYSIZE(device); d++)
+		printf(" %10.0f", (base + s->io_time[d]) / 1000.0);
+	printf("\n");
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-l line_size] [-s size,...] [-w ways] [-r window,...] trace.trc\n", name);
+	fprintf(stderr, "  -l  Cache line size (default 4K)\n");
+	fprintf(stderr, "  -s  Cache sizes to simulate (default 256K,1M,4M,16M,64M)\n");
+	fprintf(stderr, "  -w  Ways of the set associative cache (default 4)\n");
+	fprintf(stderr, "  -r  Read-ahead windows to simulate (default 64K,256K,1M)\n");
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	static const struct { model_type_t type; const char* name; } model[] = {
+		{ MODEL_LRU, "LRU" },
+		{ MODEL_ARC, "ARC" },
+		{ MODEL_SETASSOC, "Set associative" },
+		{ MODEL_READAHEAD, "Read-ahead" },
+		{ MODEL_EXTENT, "Extent prefetch" },
+	};
+	uint64_t sizes[MAX_SIZES] = { 256 << 10, 1 << 20, 4 << 20, 16 << 20, 64 << 20 };
+	uint64_t windows[MAX_WINDOWS] = { 64 << 10, 256 << 10, 1 << 20 };
+	size_t nsizes = 5, nwindows = 3, m, i, w, d;
+	const char* path = NULL;
+	char name[32];
+	uint64_t span = 0, recorded = 0;
+	double base;
+	stats_t s;
+	FILE* fd;
+	int a;
+
+	for (a = 1; a < argc; a++) {
+		if ((argv[a][0] == '-') && (a + 1 < argc)) {
+			switch (argv[a][1]) {
+			case 'l': line_size = (uint32_t)parse_size(argv[++a]); break;
+			case 's': nsizes = parse_list(argv[++a], sizes, MAX_SIZES); break;
+			case 'w': ways = (uint32_t)parse_size(argv[++a]); break;
+			case 'r': nwindows = parse_list(argv[++a], windows, MAX_WINDOWS); break;
+			default: usage(argv[0]);
+			}
+		} else if (path == NULL) {
+			path = argv[a];
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if ((path == NULL) || (line_size == 0) || (ways == 0))
+		usage(argv[0]);
+
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		perror(path);
+		return 1;
+	}
+	if ((fread(&header, sizeof(header), 1, fd) != 1) || (header.magic != TRACE_MAGIC) ||
+		(header.version != TRACE_VERSION) || (header.entry_size != sizeof(trace_entry_t))) {
+		fprintf(stderr, "%s: Not a supported trace\n", path);
+		return 1;
+	}
+	entry = malloc((header.count + 1) * sizeof(trace_entry_t));
+	if (fread(entry, sizeof(trace_entry_t), header.count, fd) != header.count) {
+		fprintf(stderr, "%s: Truncated trace\n", path);
+		return 1;
+	}
+	fclose(fd);
+
+	for (i = 0; i < header.count; i++)
+		recorded += entry[i].duration;
+	if (header.count > 0)
+		span = (uint64_t)entry[header.count - 1].time + entry[header.count - 1].duration;
+	build_extents();
+	// Without any I/O, this is how long the traced part of the boot would take
+	base = (span > recorded) ? (double)(span - recorded) : 0.0;
+
+	printf("%s: %u request(s) (%u dropped), %u extent(s), %.1f ms traced, %.1f ms of I/O\n", path,
+		header.count, header.dropped, (unsigned)extent_count, span / 1000.0, recorded / 1000.0);
+	printf("Line size: %u bytes, block size: %u bytes, media size: %llu MB\n\n", line_size,
+		header.block_size, (unsigned long long)(header.media_size >> 20));
+	printf("%-22s %6s %8s %8s %9s", "Model", "Size", "Hit rate", "Requests", "MB read");
+	for (d = 0; d < ARRAYSIZE(device); d++)
+		printf(" %7s ms", device[d].name);
+	printf("\n");
+
+	simulate(MODEL_NONE, 0, 0, &s);
+	print_row("None", 0, &s, base);
+	for (m = 0; m < ARRAYSIZE(model); m++) {
+		for (i = 0; i < nsizes; i++) {
+			if (model[m].type != MODEL_READAHEAD) {
+				if (model[m].type == MODEL_SETASSOC)
+					snprintf(name, sizeof(name), "%s %u-way", model[m].name, ways);
+				else
+					snprintf(name, sizeof(name), "%s", model[m].name);
+				simulate(model[m].type, (size_t)sizes[i], 0, &s);
+				print_row(name, sizes[i], &s, base);
+				continue;
+			}
+			for (w = 0; w < nwindows; w++) {
+				snprintf(name, sizeof(name), "%s %lluK", model[m].name, (unsigned long long)(windows[w] >> 10));
+				simulate(model[m].type, (size_t)sizes[i], windows[w], &s);
+				print_row(name, sizes[i], &s, base);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Boot telemetry decoder
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This host tool decodes the telemetry that uefi-ntfs publishes, as the
+ * volatile UefiNtfsTelemetry variable, right before it starts the bootloader.
+ * Build it with:
+ *
+ *   gcc -O2 -o decode-telemetry tools/decode-telemetry.c
+ *
+ * Without arguments, the variable is read from efivarfs, which only works on
+ * Linux. Otherwise, the file given on the command line is decoded, which can
+ * either be a copy of the efivarfs file, that starts with the attributes of
+ * the variable, or the raw content of the variable (as obtained on Windows
+ * with GetFirmwareEnvironmentVariable() for instance).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Must be kept in sync with telemetry.c */
+#define TELEMETRY_MAGIC         0x4D544E55	/* "UNTM" */
+#define TELEMETRY_VERSION       1
+#define TELEMETRY_PHASES        8
+#define TELEMETRY_EFIVARFS      "/sys/firmware/efi/efivars/UefiNtfsTelemetry-6c9a8f4e-3b1d-4e7a-9c52-1f8d3e6a27b4"
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	uint32_t launches;
+	int32_t  secure_boot;
+	uint32_t profile_flags;
+	uint32_t total_time;
+	uint32_t phase_count;
+	uint32_t phase_time[TELEMETRY_PHASES];
+	uint32_t transfer_size;
+	uint32_t metadata_hits;
+	uint32_t metadata_misses;
+	uint32_t metadata_bypassed;
+	uint32_t read_ahead_extents;
+	uint64_t read_ahead_size;
+	uint32_t overlay_writes;
+	uint32_t overlay_rejected;
+	uint16_t app_version[16];
+	uint16_t transport[16];
+	uint16_t file_system[8];
+	uint16_t driver[64];
+	uint16_t loader[64];
+} telemetry_t;
+#pragma pack(pop)
+
+#define ARRAYSIZE(a)            (sizeof(a) / sizeof((a)[0]))
+
+/* Must be kept in sync with the BOOT_PHASE and PROFILE_ definitions from boot.h */
+static const char* phase_name[] = { "Disconnect", "Scan", "Driver", "Connect", "Open", "Loader" };
+static const char* flag_name[] = { "skip disconnect" };
+
+/* Our strings are short and mostly ASCII, so we don't bother with a full UTF-16 conversion */
+static const char* to_ascii(const uint16_t* str, size_t max)
+{
+	static char buf[4][128];
+	static int index = 0;
+	char* s = buf[index++ % ARRAYSIZE(buf)];
+	size_t i;
+
+	for (i = 0; (i < max) && (i < sizeof(buf[0]) - 1) && (str[i] != 0); i++)
+		s[i] = (str[i] < 0x80) ? (char)str[i] : '?';
+	s[i] = 0;
+	return s;
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = (argc > 1) ? argv[1] : TELEMETRY_EFIVARFS;
+	uint8_t buf[sizeof(telemetry_t) + 4];
+	telemetry_t t;
+	size_t size, offset = 0;
+	uint32_t i, hits, total;
+	FILE* fd;
+
+	if ((argc > 2) || ((argc == 2) && (argv[1][0] == '-'))) {
+		fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+		return 1;
+	}
+
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		perror(path);
+		return 1;
+	}
+	size = fread(buf, 1, sizeof(buf), fd);
+	fclose(fd);
+
+	// efivarfs prefixes the data with the 32-bit attributes of the variable
+	if ((size >= 4) && (*(uint32_t*)buf != TELEMETRY_MAGIC))
+		offset = 4;
+	if (size < offset + sizeof(t)) {
+		fprintf(stderr, "%s: Truncated telemetry\n", path);
+		return 1;
+	}
+	memcpy(&t, &buf[offset], sizeof(t));
+	if ((t.magic != TELEMETRY_MAGIC) || (t.version != TELEMETRY_VERSION) || (t.size != sizeof(t))) {
+		fprintf(stderr, "%s: Not a supported telemetry\n", path);
+		return 1;
+	}
+
+	printf("UEFI:NTFS %s\n", to_ascii(t.app_version, ARRAYSIZE(t.app_version)));
+	printf("Bootloader:     %s (launched %u time(s))\n", to_ascii(t.loader, ARRAYSIZE(t.loader)), t.launches);
+	printf("File system:    %s, with %s\n", to_ascii(t.file_system, ARRAYSIZE(t.file_system)),
+		(t.driver[0] == 0) ? "the firmware driver" : to_ascii(t.driver, ARRAYSIZE(t.driver)));
+	printf("Secure Boot:    %s\n", (t.secure_boot > 0) ? "Enabled" : ((t.secure_boot < 0) ? "Setup Mode" : "Disabled"));
+	printf("Boot disk:      %s, %u KB reads\n", to_ascii(t.transport, ARRAYSIZE(t.transport)), t.transfer_size / 1024);
+	printf("Profile flags:  0x%08x", t.profile_flags);
+	for (i = 0; i < ARRAYSIZE(flag_name); i++) {
+		if (t.profile_flags & (1u << i))
+			printf(" [%s]", flag_name[i]);
+	}
+	printf("\n\nTotal time:     %u ms\n", t.total_time);
+	for (i = 0; (i < t.phase_count) && (i < TELEMETRY_PHASES); i++)
+		printf("  %-12s  %u ms\n", (i < ARRAYSIZE(phase_name)) ? phase_name[i] : "(unknown)", t.phase_time[i]);
+
+	hits = t.metadata_hits;
+	total = t.metadata_hits + t.metadata_misses;
+	printf("\nMetadata cache: %u hit(s), %u miss(es) (%.1f%% hit rate), %u large read(s)\n",
+		hits, t.metadata_misses, (total == 0) ? 0.0 : 100.0 * hits / total, t.metadata_bypassed);
+	printf("Read-ahead:     %llu KB in %u extent(s)\n", (unsigned long long)(t.read_ahead_size / 1024), t.read_ahead_extents);
+	printf("Read-only:      %u write(s) kept in RAM, %u rejected\n", t.overlay_writes, t.overlay_rejected);
+	return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Generate the embedded_driver.h that builds a file system driver into uefi-ntfs
+# Usage: tools/embed.sh <driver.efi> [embedded_driver.h]
+set -e
+if [ ! -f "$1" ]; then
+  echo "Usage: $0 <driver.efi> [embedded_driver.h]" >&2
+  exit 1
+fi
+out=${2:-embedded_driver.h}
+# The driver is used for the file system its name starts with (e.g. ntfs_x64.efi)
+name=$(basename "$1" | cut -d_ -f1 | tr 'A-Z' 'a-z')
+{
+  echo "/* Generated from $(basename "$1") by tools/embed.sh - DO NOT EDIT */"
+  echo "#define EMBEDDED_DRIVER_NAME L\"$name\""
+  echo "EMBEDDED_DRIVER_SECTION static CONST UINT8 EmbeddedDriver[] = {"
+  od -An -v -tx1 "$1" | sed -e 's/ \([0-9a-f][0-9a-f]\)/0x\1,/g'
+  echo "};"
+} > "$out"
@@ -0,0 +1,344 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Device path matching benchmark
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This host tool compares the two ways we have had of finding the partitions
+ * of the boot disk, when scanning all the BlockIo handles of a system:
+ * - Duplicating the device path of each handle, truncating its last node with
+ *   GetParentDevice() and comparing the result with CompareDevicePaths().
+ * - Walking each device path once with InitDevicePathView(), then matching it
+ *   with IsSameDevicePath() and IsParentDevicePath().
+ * The boot disk is either a USB device behind a chain of hubs, which makes for
+ * the deepest paths we see, or an NVMe namespace behind a PCIe bridge. Build it
+ * with:
+ *
+ *   gcc -O2 -o pathbench tools/pathbench.c
+ *
+ * The device path code below must be kept in sync with path.c.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ARRAYSIZE(a)            (sizeof(a) / sizeof((a)[0]))
+#define MAX_PATH_SIZE           512
+#define MAX_HANDLES             256
+#define DEFAULT_ITERATIONS      20000
+
+/* Device path node types and subtypes, from the UEFI specifications */
+#define HARDWARE_DEVICE_PATH    0x01
+#define ACPI_DEVICE_PATH        0x02
+#define MESSAGING_DEVICE_PATH   0x03
+#define MEDIA_DEVICE_PATH       0x04
+#define END_DEVICE_PATH_TYPE    0x7f
+#define HW_PCI_DP               0x01
+#define ACPI_DP                 0x01
+#define MSG_USB_DP              0x05
+#define MSG_NVME_NAMESPACE_DP   0x17
+#define MEDIA_HARDDRIVE_DP      0x01
+#define END_ENTIRE_DEVICE_PATH_SUBTYPE 0xff
+
+typedef struct {
+	uint8_t type;
+	uint8_t subtype;
+	uint8_t length[2];
+} device_path_t;
+
+typedef struct {
+	const device_path_t* path;
+	size_t size;
+	size_t parent_size;
+} path_view_t;
+
+typedef struct {
+	uint8_t data[MAX_PATH_SIZE];
+	size_t size;
+} path_buffer_t;
+
+static path_buffer_t handle[MAX_HANDLES];
+static size_t num_handles;
+
+static size_t node_length(const device_path_t* dp)
+{
+	return dp->length[0] | (dp->length[1] << 8);
+}
+
+static int is_end(const device_path_t* dp)
+{
+	return (dp->type == END_DEVICE_PATH_TYPE) && (dp->subtype == END_ENTIRE_DEVICE_PATH_SUBTYPE);
+}
+
+static const device_path_t* next_node(const device_path_t* dp)
+{
+	return (const device_path_t*)((const uint8_t*)dp + node_length(dp));
+}
+
+static void add_node(path_buffer_t* p, uint8_t type, uint8_t subtype, size_t len, uint32_t value)
+{
+	device_path_t* dp = (device_path_t*)&p->data[p->size];
+
+	memset(dp, 0, len);
+	dp->type = type;
+	dp->subtype = subtype;
+	dp->length[0] = (uint8_t)len;
+	dp->length[1] = (uint8_t)(len >> 8);
+	if (len >= 8)
+		memcpy(&p->data[p->size + 4], &value, sizeof(value));
+	p->size += len;
+}
+
+static void end_path(path_buffer_t* p)
+{
+	add_node(p, END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE, 4, 0);
+}
+
+/* PciRoot(0)/Pci(dev,fn), which all our paths start with */
+static void start_path(path_buffer_t* p, uint32_t pci)
+{
+	p->size = 0;
+	add_node(p, ACPI_DEVICE_PATH, ACPI_DP, 12, 0x0a0341d0);
+	add_node(p, HARDWARE_DEVICE_PATH, HW_PCI_DP, 6, 0);
+	p->data[p->size - 2] = (uint8_t)pci;
+}
+
+/* A disk, and its partitions, each of them being a handle */
+static void add_disk(const path_buffer_t* disk, int partitions, uint32_t signature)
+{
+	int i;
+
+	for (i = 0; (i <= partitions) && (num_handles < MAX_HANDLES); i++) {
+		path_buffer_t* p = &handle[num_handles++];
+		memcpy(p->data, disk->data, disk->size);
+		p->size = disk->size;
+		// The whole disk comes first, with no partition node
+		if (i > 0)
+			add_node(p, MEDIA_DEVICE_PATH, MEDIA_HARDDRIVE_DP, 42, signature + i);
+		end_path(p);
+	}
+}
+
+/* Set up the handles of a system with a few disks, one of them being our boot disk */
+static void build_system(int nvme, int hubs, path_buffer_t* boot_disk, path_buffer_t* boot_partition)
+{
+	path_buffer_t disk;
+	int i, j;
+
+	num_handles = 0;
+	// Internal SATA and NVMe disks, that are not the boot disk
+	for (i = 0; i < 2; i++) {
+		start_path(&disk, 0x17 + i);
+		add_disk(&disk, 4, 0x1000 * (i + 1));
+	}
+	// A few other USB devices, on the same root hub as our boot disk
+	for (i = 0; i < 4; i++) {
+		start_path(&disk, 0x14);
+		for (j = 0; j < hubs; j++)
+			add_node(&disk, MESSAGING_DEVICE_PATH, MSG_USB_DP, 6, 0);
+		disk.data[disk.size - 2] = (uint8_t)(i + 1);
+		add_disk(&disk, 2, 0x8000 * (i + 1));
+	}
+	if (nvme) {
+		start_path(&disk, 0x1c);
+		add_node(&disk, HARDWARE_DEVICE_PATH, HW_PCI_DP, 6, 0);
+		add_node(&disk, MESSAGING_DEVICE_PATH, MSG_NVME_NAMESPACE_DP, 16, 1);
+	} else {
+		start_path(&disk, 0x14);
+		// One node per hub, then the port the device sits on
+		for (j = 0; j <= hubs; j++)
+			add_node(&disk, MESSAGING_DEVICE_PATH, MSG_USB_DP, 6, 0);
+	}
+	memcpy(boot_disk, &disk, sizeof(disk));
+	end_path(boot_disk);
+	add_disk(&disk, 2, 0xb007);
+	// We booted from the first partition of the boot disk
+	memcpy(boot_partition, &handle[num_handles - 2], sizeof(*boot_partition));
+}
+
+/*
+ * The previous way of doing things, through copies
+ */
+static device_path_t* get_parent_device(const device_path_t* dp)
+{
+	const device_path_t *p, *last = dp;
+	size_t size = 0;
+	device_path_t* copy;
+
+	for (p = dp; !is_end(p); p = next_node(p)) {
+		last = p;
+		size += node_length(p);
+	}
+	copy = malloc(size + 4);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, dp, size + 4);
+	p = (device_path_t*)((uint8_t*)copy + ((const uint8_t*)last - (const uint8_t*)dp));
+	((device_path_t*)p)->type = END_DEVICE_PATH_TYPE;
+	((device_path_t*)p)->subtype = END_ENTIRE_DEVICE_PATH_SUBTYPE;
+	((device_path_t*)p)->length[0] = 4;
+	((device_path_t*)p)->length[1] = 0;
+	return copy;
+}
+
+static int compare_device_paths(const device_path_t* dp1, const device_path_t* dp2)
+{
+	size_t len1, len2;
+	int ret;
+
+	while (1) {
+		if (dp1->type != dp2->type)
+			return (int)dp2->type - (int)dp1->type;
+		if (dp1->subtype != dp2->subtype)
+			return (int)dp1->subtype - (int)dp2->subtype;
+		len1 = node_length(dp1);
+		len2 = node_length(dp2);
+		if (len1 != len2)
+			return (int)len1 - (int)len2;
+		ret = memcmp(dp1, dp2, len1);
+		if (ret != 0)
+			return ret;
+		if (is_end(dp1))
+			break;
+		dp1 = next_node(dp1);
+		dp2 = next_node(dp2);
+	}
+	return 0;
+}
+
+static size_t scan_with_copies(const device_path_t* boot_partition, const device_path_t* boot_disk)
+{
+	const device_path_t* dp;
+	device_path_t* parent;
+	size_t i, found = 0;
+
+	for (i = 0; i < num_handles; i++) {
+		dp = (const device_path_t*)handle[i].data;
+		if (compare_device_paths(dp, boot_partition) == 0)
+			continue;
+		parent = get_parent_device(dp);
+		if ((parent != NULL) && (compare_device_paths(boot_disk, parent) == 0))
+			found++;
+		free(parent);
+	}
+	return found;
+}
+
+/*
+ * The current way of doing things, through views
+ */
+static void init_view(path_view_t* view, const device_path_t* dp)
+{
+	size_t len;
+
+	view->path = dp;
+	view->size = view->parent_size = 0;
+	while (!((dp->type & 0x7f) == END_DEVICE_PATH_TYPE)) {
+		len = node_length(dp);
+		if (len < sizeof(device_path_t))
+			break;
+		view->parent_size = view->size;
+		view->size += len;
+		dp = next_node(dp);
+	}
+}
+
+static int is_same_path(const path_view_t* view1, const path_view_t* view2)
+{
+	if (view1->size != view2->size)
+		return 0;
+	return memcmp(view1->path, view2->path, view1->size) == 0;
+}
+
+static int is_parent_path(const path_view_t* parent, const path_view_t* child)
+{
+	if ((child->size == 0) || (child->parent_size != parent->size))
+		return 0;
+	return memcmp(parent->path, child->path, parent->size) == 0;
+}
+
+static size_t scan_with_views(const path_view_t* boot_partition, const path_view_t* boot_disk)
+{
+	path_view_t view;
+	size_t i, found = 0;
+
+	for (i = 0; i < num_handles; i++) {
+		init_view(&view, (const device_path_t*)handle[i].data);
+		if (is_same_path(&view, boot_partition))
+			continue;
+		if (is_parent_path(boot_disk, &view))
+			found++;
+	}
+	return found;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+	static const struct { const char* name; int nvme; int hubs; } config[] = {
+		{ "USB, no hub", 0, 0 },
+		{ "USB, 2 hubs", 0, 2 },
+		{ "USB, 5 hubs", 0, 5 },
+		{ "NVMe", 1, 0 },
+	};
+	long iterations = (argc > 1) ? atol(argv[1]) : DEFAULT_ITERATIONS;
+	path_buffer_t boot_disk, boot_partition;
+	path_view_t disk_view, partition_view;
+	size_t c, found_copies = 0, found_views = 0;
+	double start, copies, views;
+	long n;
+
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-14s %8s %7s %14s %14s %8s\n", "Boot disk", "Handles", "Path", "Copies", "Views", "Speedup");
+	for (c = 0; c < ARRAYSIZE(config); c++) {
+		build_system(config[c].nvme, config[c].hubs, &boot_disk, &boot_partition);
+		start = now();
+		for (n = 0; n < iterations; n++)
+			found_copies = scan_with_copies((const device_path_t*)boot_partition.data,
+				(const device_path_t*)boot_disk.data);
+		copies = (now() - start) / iterations;
+		start = now();
+		for (n = 0; n < iterations; n++) {
+			// The views of the boot partition and disk are set once per scan, as in boot.c
+			init_view(&partition_view, (const device_path_t*)boot_partition.data);
+			init_view(&disk_view, (const device_path_t*)boot_disk.data);
+			found_views = scan_with_views(&partition_view, &disk_view);
+		}
+		views = (now() - start) / iterations;
+		if (found_copies != found_views) {
+			fprintf(stderr, "%s: %zu partition(s) found with copies, but %zu with views\n",
+				config[c].name, found_copies, found_views);
+			return 1;
+		}
+		printf("%-14s %8zu %5zu B %11.0f ns %11.0f ns %7.1fx\n", config[c].name, num_handles,
+			boot_partition.size, copies, views, copies / views);
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Disk access trace
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_TRACE
+/*
+ * To size our caches from actual data, we can record every request the file
+ * system driver makes to the DiskIo of the target partition, along with how
+ * long the request took, and write the whole trace to the FAT partition along
+ * with the log. The trace can then be replayed against various cache models,
+ * with tools/cachesim.c. The format below must be kept in sync with the tool.
+ */
+#define TRACE_PATH              L"\\efi\\rufus\\uefi-ntfs.trc"
+#define TRACE_MAGIC             0x43525442	/* "BTRC" */
+#define TRACE_VERSION           1
+#define TRACE_MAX_ENTRIES       65536
+
+#define TRACE_OP_READ           0
+#define TRACE_OP_WRITE          1
+
+#pragma pack(push, 1)
+typedef struct {
+	UINT8   Op;
+	UINT8   Reserved[3];
+	UINT32  Size;
+	UINT32  Time;			/* Start of the request, in µs since the start of the trace */
+	UINT32  Duration;		/* In µs */
+	UINT64  Offset;
+} TRACE_ENTRY;
+
+typedef struct {
+	UINT32  Magic;
+	UINT16  Version;
+	UINT16  EntrySize;
+	UINT32  Count;
+	UINT32  Dropped;		/* Requests that did not fit in the trace */
+	UINT32  BlockSize;
+	UINT32  Reserved;
+	UINT64  MediaSize;
+} TRACE_HEADER;
+#pragma pack(pop)
+
+static EFI_DISK_IO_PROTOCOL* DiskIo = NULL;
+static EFI_DISK_READ OrgReadDisk;
+static EFI_DISK_WRITE OrgWriteDisk;
+/* The entries directly follow the header */
+static TRACE_HEADER* Trace = NULL;
+static TRACE_ENTRY* TraceEntry;
+static UINT64 TraceStart;
+
+static EFI_STATUS TraceRequest(CONST UINT8 Op, EFI_DISK_IO_PROTOCOL* This, CONST UINT32 MediaId,
+	CONST UINT64 Offset, CONST UINTN BufferSize, VOID* Buffer)
+{
+	EFI_STATUS Status;
+	TRACE_ENTRY* Entry;
+	UINT64 Start = GetElapsedTimeUs();
+
+	Status = (Op == TRACE_OP_WRITE) ? OrgWriteDisk(This, MediaId, Offset, BufferSize, Buffer) :
+		OrgReadDisk(This, MediaId, Offset, BufferSize, Buffer);
+	if (Trace->Count >= TRACE_MAX_ENTRIES) {
+		Trace->Dropped++;
+		return Status;
+	}
+	Entry = &TraceEntry[Trace->Count++];
+	Entry->Op = Op;
+	Entry->Size = (UINT32)BufferSize;
+	Entry->Time = (UINT32)(Start - TraceStart);
+	Entry->Duration = (UINT32)(GetElapsedTimeUs() - Start);
+	Entry->Offset = Offset;
+	return Status;
+}
+
+static EFI_STATUS EFIAPI TracedReadDisk(EFI_DISK_IO_PROTOCOL* This, UINT32 MediaId,
+	UINT64 Offset, UINTN BufferSize, VOID* Buffer)
+{
+	return TraceRequest(TRACE_OP_READ, This, MediaId, Offset, BufferSize, Buffer);
+}
+
+static EFI_STATUS EFIAPI TracedWriteDisk(EFI_DISK_IO_PROTOCOL* This, UINT32 MediaId,
+	UINT64 Offset, UINTN BufferSize, VOID* Buffer)
+{
+	return TraceRequest(TRACE_OP_WRITE, This, MediaId, Offset, BufferSize, Buffer);
+}
+
+/*
+ * Start recording the requests made to the DiskIo of the target partition.
+ * This must be done last, so that the requests are recorded as the driver
+ * issues them, before any of our caches get to serve them.
+ */
+EFI_STATUS StartTrace(CONST EFI_HANDLE TargetHandle)
+{
+	EFI_STATUS Status;
+	EFI_BLOCK_IO_PROTOCOL* BlockIo;
+
+	if (DiskIo != NULL)
+		return EFI_ALREADY_STARTED;
+
+	Status = gBS->HandleProtocol(TargetHandle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = gBS->HandleProtocol(TargetHandle, &gEfiDiskIoProtocolGuid, (VOID**)&DiskIo);
+	if (EFI_ERROR(Status)) {
+		DiskIo = NULL;
+		return Status;
+	}
+	Trace = AllocateZeroPool(sizeof(TRACE_HEADER) + TRACE_MAX_ENTRIES * sizeof(TRACE_ENTRY));
+	if (Trace == NULL) {
+		DiskIo = NULL;
+		return EFI_OUT_OF_RESOURCES;
+	}
+	TraceEntry = (TRACE_ENTRY*)&Trace[1];
+	Trace->Magic = TRACE_MAGIC;
+	Trace->Version = TRACE_VERSION;
+	Trace->EntrySize = sizeof(TRACE_ENTRY);
+	Trace->BlockSize = BlockIo->Media->BlockSize;
+	Trace->MediaSize = MultU64x32(BlockIo->Media->LastBlock + 1, BlockIo->Media->BlockSize);
+	TraceStart = GetElapsedTimeUs();
+
+	OrgReadDisk = DiskIo->ReadDisk;
+	OrgWriteDisk = DiskIo->WriteDisk;
+	DiskIo->ReadDisk = TracedReadDisk;
+	DiskIo->WriteDisk = TracedWriteDisk;
+	return EFI_SUCCESS;
+}
+
+/* Write the requests recorded so far to the FAT partition */
+EFI_STATUS SaveTrace(CONST EFI_FILE_HANDLE Root)
+{
+	if ((Root == NULL) || (Trace == NULL))
+		return EFI_INVALID_PARAMETER;
+	PrintDebug(L"Saving trace of %d disk request(s) (%d dropped)", Trace->Count, Trace->Dropped);
+	return WriteFileData(Root, TRACE_PATH, Trace, sizeof(TRACE_HEADER) + Trace->Count * sizeof(TRACE_ENTRY));
+}
+
+/* Stop recording, which must be done before we exit */
+VOID StopTrace(VOID)
+{
+	if (DiskIo != NULL) {
+		DiskIo->ReadDisk = OrgReadDisk;
+		DiskIo->WriteDisk = OrgWriteDisk;
+		DiskIo = NULL;
+	}
+	if (Trace != NULL)
+		SafeFree(Trace);
+}
+#endif
@@ -0,0 +1,224 @@
+/*
+ * uefi-ntfs: UEFI → NTFS/exFAT chain loader - Secure Boot preflight
+ * Copyright © 2014-2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#if FEATURE_PREFLIGHT
+/*
+ * GUIDs for the entries of the Secure Boot databases. Not all of these are
+ * provided by the environments we build with, so we use our own.
+ */
+static EFI_GUID CertSha256Guid =
+	{ 0xc1c41626, 0x504c, 0x4092, { 0xac, 0xa9, 0x41, 0xf9, 0x36, 0x93, 0x43, 0x28 } };
+static EFI_GUID CertX509Guid =
+	{ 0xa5c059a1, 0x94e4, 0x4aa7, { 0x87, 0xb5, 0xab, 0x15, 0x5c, 0x2b, 0xf0, 0x72 } };
+
+/* Size of an EFI_SIGNATURE_LIST header and of the owner GUID of each entry */
+#define SIGNATURE_LIST_SIZE     28
+#define SIGNATURE_OWNER_SIZE    16
+
+/*
+ * The certificates that Windows and third party UEFI bootloaders chain to.
+ * We look for their name in the signature of a bootloader, as well as in the
+ * certificates of the Secure Boot databases, which is a lot faster and much
+ * simpler than a full X.509 validation, and good enough for a diagnostic.
+ */
+static CONST CHAR8* KnownCertificate[] = {
+	"Microsoft Windows Production PCA 2011",
+	"Windows UEFI CA 2023",
+	"Microsoft Corporation UEFI CA 2011",
+	"Microsoft UEFI CA 2023",
+};
+
+/*
+ * Look for an entry in a signature database (db or dbx). If Partial is TRUE,
+ * Data only needs to be part of the entry, otherwise it must be the entry.
+ */
+static BOOLEAN FindSignature(CONST UINT8* Db, CONST UINTN DbSize, CONST EFI_GUID* Type,
+	CONST VOID* Data, CONST UINTN DataSize, CONST BOOLEAN Partial)
+{
+	UINT32 ListSize, HeaderSize, EntrySize;
+	UINTN List, Entry;
+
+	for (List = 0; List + SIGNATURE_LIST_SIZE <= DbSize; List += ListSize) {
+		CopyMem(&ListSize, &Db[List + 16], sizeof(UINT32));
+		CopyMem(&HeaderSize, &Db[List + 20], sizeof(UINT32));
+		CopyMem(&EntrySize, &Db[List + 24], sizeof(UINT32));
+		if ((ListSize < SIGNATURE_LIST_SIZE) || (ListSize > DbSize - List) ||
+			(EntrySize <= SIGNATURE_OWNER_SIZE) || (HeaderSize > ListSize - SIGNATURE_LIST_SIZE))
+			break;
+		if (!COMPARE_GUID((EFI_GUID*)&Db[List], (EFI_GUID*)Type))
+			continue;
+		for (Entry = List + SIGNATURE_LIST_SIZE + HeaderSize; Entry + EntrySize <= List + ListSize; Entry += EntrySize) {
+			if (Partial) {
+				if (FindMem(&Db[Entry + SIGNATURE_OWNER_SIZE], EntrySize - SIGNATURE_OWNER_SIZE, Data, DataSize))
+					return TRUE;
+			} else if ((EntrySize - SIGNATURE_OWNER_SIZE == DataSize) &&
+				(CompareMem(&Db[Entry + SIGNATURE_OWNER_SIZE], Data, DataSize) == 0)) {
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+/* Parse an unsigned decimal number from a CSV field */
+static UINT32 GetCsvNumber(CONST CHAR8* p, CONST CHAR8* End)
+{
+	UINT32 Value = 0;
+
+	for (; (p < End) && (*p >= '0') && (*p <= '9'); p++)
+		Value = Value * 10 + (*p - '0');
+	return Value;
+}
+
+/*
+ * Look up the minimum generation of an SBAT component in the revocation
+ * data (SbatLevel), which is made of "component,generation" lines.
+ */
+static UINT32 GetSbatLevel(CONST CHAR8* Level, CONST UINTN LevelSize, CONST CHAR8* Name, CONST UINTN NameLen)
+{
+	CONST CHAR8 *Line, *End = Level + LevelSize, *Eol;
+
+	for (Line = Level; Line < End; Line = Eol + 1) {
+		for (Eol = Line; (Eol < End) && (*Eol != '\n'); Eol++);
+		if ((Line + NameLen < Eol) && (Line[NameLen] == ',') && (CompareMem(Line, Name, NameLen) == 0))
+			return GetCsvNumber(&Line[NameLen + 1], Eol);
+	}
+	return 0;
+}
+
+/*
+ * Check the SBAT section of a bootloader, which is made of lines such as
+ * "grub,3,Free Software Foundation,grub,2.06,https://www.gnu.org/software/grub/"
+ * against the SBAT revocations that shim installed on this machine.
+ */
+static BOOLEAN IsSbatRevoked(CONST UINT8* Image, CONST UINTN Size, CONST PLATFORM_STATE* State)
+{
+	CONST CHAR8 *Sbat, *Line, *End, *Eol, *Comma, *Level = State->SbatLevel;
+	CHAR8 Name[64];
+	UINTN SbatSize, LevelSize = State->SbatLevelSize, NameLen;
+	UINT32 Generation, MinGeneration;
+	BOOLEAN Revoked = FALSE;
+
+	if ((Level == NULL) || (GetPeSection(Image, Size, ".sbat", (CONST UINT8**)&Sbat, &SbatSize) != EFI_SUCCESS))
+		return FALSE;
+
+	End = Sbat + SbatSize;
+	for (Line = Sbat; (Line < End) && (*Line != 0); Line = Eol + 1) {
+		for (Eol = Line; (Eol < End) && (*Eol != '\n') && (*Eol != 0); Eol++);
+		for (Comma = Line; (Comma < Eol) && (*Comma != ','); Comma++);
+		NameLen = Comma - Line;
+		if ((Comma >= Eol) || (NameLen == 0) || (NameLen >= STRING_MAX))
+			continue;
+		Generation = GetCsvNumber(Comma + 1, Eol);
+		MinGeneration = GetSbatLevel(Level, LevelSize, Line, NameLen);
+		// The "sbat" line is the version of the SBAT format, not a component
+		if ((Generation < MinGeneration) && !((NameLen == 4) && (CompareMem(Line, "sbat", 4) == 0))) {
+			// Our print functions expect NUL terminated strings, so use a copy
+			NameLen = (NameLen < sizeof(Name) - 1) ? NameLen : sizeof(Name) - 1;
+			CopyMem(Name, Line, NameLen);
+			Name[NameLen] = 0;
+			PrintWarning(L"  SBAT revokes '%a' generation %d (minimum is %d)", Name, Generation, MinGeneration);
+			Revoked = TRUE;
+		}
+	}
+
+	return Revoked;
+}
+
+/*
+ * Check a bootloader we are about to launch against the Secure Boot db and
+ * dbx, as well as the SBAT revocations, so that we can report why it will
+ * be rejected in a few milliseconds, rather than have it fail silently.
+ * Identity, if not NULL, is used to look up the digest of the image in our cache.
+ * Returns EFI_SECURITY_VIOLATION if the bootloader is sure to be rejected.
+ */
+EFI_STATUS CheckRevocation(CONST UINT8* Image, CONST UINTN Size, CONST FILE_IDENTITY* Identity)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	CONST PLATFORM_STATE* State;
+	CONST UINT8 *Signature, *Db, *Dbx;
+	UINT8 Digest[SHA256_DIGEST_SIZE];
+	UINTN i, DbSize, DbxSize, SignatureSize = 0, Len;
+	BOOLEAN Signed, Trusted = FALSE, Known = FALSE;
+
+	// Only hash the bootloader if it changed since the last time we did
+	if ((Identity != NULL) && LookupDigest(Identity, Digest)) {
+		PrintDebug(L"  Using cached bootloader digest");
+	} else {
+		if (GetAuthenticodeHash(Image, Size, Digest) != EFI_SUCCESS) {
+			PrintWarning(L"  Bootloader is not a valid executable");
+			return EFI_LOAD_ERROR;
+		}
+		if (Identity != NULL)
+			StoreDigest(Identity, Digest);
+	}
+	// This does nothing if the databases were read while we were waiting on the firmware
+	ReadSecureBootDatabases();
+	State = GetPlatformState();
+	Db = State->Db;
+	DbSize = State->DbSize;
+	Dbx = State->Dbx;
+	DbxSize = State->DbxSize;
+
+	// A revoked hash is the most common way bootloaders get rejected
+	if ((Dbx != NULL) && FindSignature(Dbx, DbxSize, &CertSha256Guid, Digest, sizeof(Digest), FALSE)) {
+		PrintWarning(L"  This bootloader was revoked by its hash in dbx");
+		Status = EFI_SECURITY_VIOLATION;
+		goto out;
+	}
+	if ((Db != NULL) && FindSignature(Db, DbSize, &CertSha256Guid, Digest, sizeof(Digest), FALSE)) {
+		PrintDebug(L"  Bootloader hash is allowed by db");
+		goto out;
+	}
+
+	Signed = (GetPeSignature(Image, Size, &Signature, &SignatureSize) == EFI_SUCCESS);
+	if (!Signed) {
+		PrintWarning(L"  This bootloader is not signed and its hash is not in db");
+		if (Db != NULL)
+			Status = EFI_SECURITY_VIOLATION;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(KnownCertificate); i++) {
+		Len = _AsciiStrLen(KnownCertificate[i]);
+		if (!FindMem(Signature, SignatureSize, KnownCertificate[i], Len))
+			continue;
+		Known = TRUE;
+		if ((Dbx != NULL) && FindSignature(Dbx, DbxSize, &CertX509Guid, KnownCertificate[i], Len, TRUE)) {
+			PrintWarning(L"  This bootloader is signed with '%a', which this system revoked", KnownCertificate[i]);
+			Status = EFI_SECURITY_VIOLATION;
+			goto out;
+		}
+		if ((Db != NULL) && FindSignature(Db, DbSize, &CertX509Guid, KnownCertificate[i], Len, TRUE)) {
+			PrintDebug(L"  Bootloader is signed with '%a', which db trusts", KnownCertificate[i]);
+			Trusted = TRUE;
+		}
+	}
+	// We can't be sure about certificates we don't know, so just warn
+	if (Known && !Trusted)
+		PrintWarning(L"  This bootloader is not signed with a certificate that this system trusts");
+
+	if (IsSbatRevoked(Image, Size, State))
+		PrintWarning(L"  This bootloader will likely be rejected by shim");
+
+out:
+	return Status;
+}
+#endif